@@ -0,0 +1,151 @@
+/* Microbenchmark for RTM event dispatch: time per event to find the handler
+ * for a realistic mix of event types, compared to the previous strcmp chain
+ * (reproduced below, with the handlers replaced by their table entries). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slack-rtm-event.h"
+
+#define EVENTS	(1 << 12) /* distinct strings, so nothing is answered from the last comparison */
+#define ROUNDS	2000
+
+/* Roughly what a busy workspace sends: mostly messages, then presence and typing */
+static const struct {
+	const char *type;
+	unsigned weight;
+} mix[] = {
+	{ "message", 55 },
+	{ "presence_change", 15 },
+	{ "user_typing", 12 },
+	{ "user_change", 4 },
+	{ "reaction_added", 4 }, /* unhandled */
+	{ "dnd_updated_user", 3 }, /* unhandled */
+	{ "member_joined_channel", 2 },
+	{ "channel_marked", 2 }, /* unhandled */
+	{ "im_open", 1 },
+	{ "channel_created", 1 },
+	{ "group_left", 1 },
+};
+
+static const SlackRTMEvent old_unhandled = { NULL, SLACK_RTM_UNHANDLED, SLACK_RTM_INVALIDATE };
+
+/* The rtm_msg chain as it was: the result stands in for which branch ran */
+static SlackRTMHandler old_dispatch(const char *type, guint *flags) {
+	*flags = strcmp(type, "user_typing") ? SLACK_RTM_INVALIDATE : 0;
+
+	if (!strcmp(type, "message"))
+		return SLACK_RTM_MESSAGE;
+	else if (!strcmp(type, "user_typing"))
+		return SLACK_RTM_USER_TYPING;
+	else if (!strcmp(type, "presence_change") ||
+	         !strcmp(type, "presence_change_batch"))
+		return SLACK_RTM_PRESENCE_CHANGE;
+	else if (!strcmp(type, "im_close"))
+		return SLACK_RTM_IM_CLOSE;
+	else if (!strcmp(type, "im_open"))
+		return SLACK_RTM_IM_OPEN;
+	else if (!strcmp(type, "member_joined_channel"))
+		return SLACK_RTM_MEMBER_JOINED;
+	else if (!strcmp(type, "member_left_channel"))
+		return SLACK_RTM_MEMBER_LEFT;
+	else if (!strcmp(type, "user_change") ||
+		 !strcmp(type, "team_join"))
+		return SLACK_RTM_USER_CHANGE;
+	else if (!strcmp(type, "im_created"))
+		return SLACK_RTM_IM_OPEN;
+	else if (!strcmp(type, "channel_joined"))
+		return SLACK_RTM_CHANNEL_MEMBER;
+	else if (!strcmp(type, "group_joined") ||
+		 !strcmp(type, "group_unarchive"))
+		return SLACK_RTM_CHANNEL_GROUP;
+	else if (!strcmp(type, "channel_left") ||
+	         !strcmp(type, "channel_created") ||
+	         !strcmp(type, "channel_unarchive"))
+		return SLACK_RTM_CHANNEL_PUBLIC;
+	else if (!strcmp(type, "channel_rename") ||
+		 !strcmp(type, "group_rename"))
+		return SLACK_RTM_CHANNEL_UNKNOWN;
+	else if (!strcmp(type, "channel_archive") ||
+		 !strcmp(type, "channel_deleted") ||
+		 !strcmp(type, "group_archive") ||
+		 !strcmp(type, "group_left"))
+		return SLACK_RTM_CHANNEL_DELETED;
+	return old_unhandled.handler;
+}
+
+static double ns(gint64 us, unsigned long n) {
+	return n ? us * 1000.0 / n : 0;
+}
+
+int main(void) {
+	/* each event gets its own copy of its type, as it would from the json parser */
+	char **events = g_new(char *, EVENTS);
+	unsigned total = 0, i, j, r;
+	for (i = 0; i < G_N_ELEMENTS(mix); i++)
+		total += mix[i].weight;
+	for (j = 0; j < EVENTS; j++) {
+		unsigned w = g_random_int_range(0, total);
+		for (i = 0; w >= mix[i].weight; i++)
+			w -= mix[i].weight;
+		events[j] = g_strdup(mix[i].type);
+	}
+
+	/* both must agree */
+	for (j = 0; j < EVENTS; j++) {
+		guint flags;
+		const SlackRTMEvent *e = slack_rtm_event_lookup(events[j]);
+		if (old_dispatch(events[j], &flags) != e->handler || flags != (e->flags & SLACK_RTM_INVALIDATE)) {
+			fprintf(stderr, "mismatch for %s\n", events[j]);
+			return 1;
+		}
+	}
+
+	unsigned long sum = 0;
+	gint64 start = g_get_monotonic_time();
+	for (r = 0; r < ROUNDS; r++)
+		for (j = 0; j < EVENTS; j++) {
+			guint flags;
+			sum += old_dispatch(events[j], &flags) + flags;
+		}
+	gint64 old = g_get_monotonic_time() - start;
+
+	start = g_get_monotonic_time();
+	for (r = 0; r < ROUNDS; r++)
+		for (j = 0; j < EVENTS; j++) {
+			const SlackRTMEvent *e = slack_rtm_event_lookup(events[j]);
+			sum -= e->handler + (e->flags & SLACK_RTM_INVALIDATE);
+		}
+	gint64 table = g_get_monotonic_time() - start;
+
+	printf("%-8s %10s\n", "dispatch", "ns/event");
+	printf("%-8s %10.1f\n", "strcmp", ns(old, (unsigned long)ROUNDS * EVENTS));
+	printf("%-8s %10.1f\n", "table", ns(table, (unsigned long)ROUNDS * EVENTS));
+
+	/* and per type */
+	printf("\n%-22s %10s %10s\n", "type", "strcmp", "table");
+	for (i = 0; i < G_N_ELEMENTS(mix); i++) {
+		char *type = g_strdup(mix[i].type);
+		start = g_get_monotonic_time();
+		for (r = 0; r < ROUNDS * 100; r++) {
+			guint flags;
+			sum += old_dispatch(type, &flags) + flags;
+			__asm__ volatile("" : : "r"(type) : "memory");
+		}
+		old = g_get_monotonic_time() - start;
+		start = g_get_monotonic_time();
+		for (r = 0; r < ROUNDS * 100; r++) {
+			const SlackRTMEvent *e = slack_rtm_event_lookup(type);
+			sum -= e->handler + (e->flags & SLACK_RTM_INVALIDATE);
+			__asm__ volatile("" : : "r"(type) : "memory");
+		}
+		table = g_get_monotonic_time() - start;
+		printf("%-22s %10.1f %10.1f\n", mix[i].type, ns(old, ROUNDS * 100), ns(table, ROUNDS * 100));
+		g_free(type);
+	}
+
+	for (j = 0; j < EVENTS; j++)
+		g_free(events[j]);
+	g_free(events);
+	return sum != 0;
+}
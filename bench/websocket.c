@@ -0,0 +1,128 @@
+/* Microbenchmark for the websocket frame codec: encode (header and masking,
+ * as purple_websocket_send does) and decode (header and unmasking) throughput
+ * for each masking implementation, compared to the previous 4-byte loop. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* for the individual masking implementations */
+#include "purple-websocket-codec.c"
+
+#define TOTAL_BYTES	(256 << 20) /* per size and implementation */
+
+/* The masking loop as it was */
+static void ws_mask_old(guchar *dst, const guchar *src, size_t len, guint32 mask) {
+	size_t i;
+	for (i = 0; i+3 < len; i+=4) {
+		guint32 m;
+		memcpy(&m, &src[i], 4);
+		m ^= mask;
+		memcpy(&dst[i], &m, 4);
+	}
+	for (; i < len; i++)
+		dst[i] = src[i] ^ ((guint8*)&mask)[i&3];
+}
+
+static const struct {
+	const char *name;
+	ws_mask_func func;
+	const char *cpu;
+} impls[] = {
+	{ "old", ws_mask_old, NULL },
+	{ "scalar", ws_mask_scalar, NULL },
+#ifdef WS_MASK_X86
+	{ "sse2", ws_mask_sse2, "sse2" },
+	{ "avx2", ws_mask_avx2, "avx2" },
+#endif
+};
+
+static gboolean supported(const char *cpu) {
+	if (!cpu)
+		return TRUE;
+#ifdef WS_MASK_X86
+	__builtin_cpu_init();
+	if (!strcmp(cpu, "sse2"))
+		return __builtin_cpu_supports("sse2");
+	if (!strcmp(cpu, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	return FALSE;
+}
+
+static size_t encode(ws_mask_func func, guchar *frame, const guchar *msg, size_t len, guint32 mask) {
+	size_t hlen = purple_websocket_frame_encode_header(frame, WS_FIN | WS_OP_TEXT, len, &mask);
+	func(frame + hlen, msg, len, mask);
+	return hlen + len;
+}
+
+static size_t decode(ws_mask_func func, guchar *frame, size_t len) {
+	PurpleWebsocketFrame f;
+	size_t hlen = purple_websocket_frame_decode_header(frame, len, &f);
+	if (hlen > len || hlen + f.len != len)
+		abort();
+	func(frame + hlen, frame + hlen, f.len, f.mask);
+	return f.len;
+}
+
+static double mbps(size_t bytes, gint64 us) {
+	return us ? (double)bytes / us : 0;
+}
+
+int main(void) {
+	static const size_t sizes[] = { 100, 1024, 16 << 10, 64 << 10, 1 << 20 };
+	size_t max = sizes[G_N_ELEMENTS(sizes)-1];
+	guchar *msg = g_malloc(max), *frame = g_malloc(max + WS_HEADER_MAX), *check = g_malloc(max + WS_HEADER_MAX);
+	size_t i, s;
+
+	for (i = 0; i < max; i++)
+		msg[i] = g_random_int();
+
+	/* every implementation must agree with the old one, at every alignment and tail length */
+	for (i = 0; i < G_N_ELEMENTS(impls); i++) {
+		if (!supported(impls[i].cpu))
+			continue;
+		for (s = 0; s < 200; s++) {
+			guint32 mask = g_random_int();
+			ws_mask_old(check, msg + (s & 7), s, mask);
+			impls[i].func(frame, msg + (s & 7), s, mask);
+			if (memcmp(check, frame, s)) {
+				fprintf(stderr, "%s: mismatch at length %zu\n", impls[i].name, s);
+				return 1;
+			}
+		}
+	}
+
+	printf("%-8s %8s %12s %12s\n", "impl", "size", "encode MB/s", "decode MB/s");
+	for (s = 0; s < G_N_ELEMENTS(sizes); s++) {
+		size_t len = sizes[s], n = TOTAL_BYTES / len, r;
+		for (i = 0; i < G_N_ELEMENTS(impls); i++) {
+			if (!supported(impls[i].cpu))
+				continue;
+			ws_mask_func func = impls[i].func;
+			size_t flen = 0;
+			gint64 start = g_get_monotonic_time();
+			for (r = 0; r < n; r++)
+				flen = encode(func, frame, msg, len, (guint32)r);
+			gint64 enc = g_get_monotonic_time() - start;
+
+			start = g_get_monotonic_time();
+			for (r = 0; r < n; r++)
+				decode(func, frame, flen);
+			gint64 dec = g_get_monotonic_time() - start;
+
+			printf("%-8s %8zu %12.0f %12.0f\n", impls[i].name, len, mbps(n * len, enc), mbps(n * len, dec));
+		}
+	}
+	printf("default: %s\n", ws_mask_select() == ws_mask_scalar ? "scalar" :
+#ifdef WS_MASK_X86
+			ws_mask_select() == ws_mask_avx2 ? "avx2" : "sse2"
+#else
+			"?"
+#endif
+			);
+
+	g_free(msg);
+	g_free(frame);
+	g_free(check);
+	return 0;
+}
@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include "purple-websocket-codec.h"
+
+/* SIMD masking, chosen at runtime; needs target attributes that work with the intrinsics headers */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define WS_MASK_X86
+#include <immintrin.h>
+#endif
+
+size_t purple_websocket_frame_header_size(guint64 len, gboolean masked) {
+	size_t n = 2;
+	if (len > G_MAXUINT16)
+		n += sizeof(guint64);
+	else if (len >= 126)
+		n += sizeof(guint16);
+	if (masked)
+		n += sizeof(guint32);
+	return n;
+}
+
+size_t purple_websocket_frame_encode_header(guchar *buf, guint8 header, guint64 len, const guint32 *mask) {
+	guchar *p = buf;
+	guint8 m = mask ? WS_MASK : 0;
+
+	*p++ = header;
+	if (len > G_MAXUINT16) {
+		guint64 v = GUINT64_TO_BE(len);
+		*p++ = m | 127;
+		memcpy(p, &v, sizeof(v));
+		p += sizeof(v);
+	} else if (len >= 126) {
+		guint16 v = GUINT16_TO_BE(len);
+		*p++ = m | 126;
+		memcpy(p, &v, sizeof(v));
+		p += sizeof(v);
+	} else
+		*p++ = m | len;
+
+	if (mask) {
+		memcpy(p, mask, sizeof(*mask));
+		p += sizeof(*mask);
+	}
+	return p - buf;
+}
+
+size_t purple_websocket_frame_decode_header(const guchar *buf, size_t len, PurpleWebsocketFrame *frame) {
+	if (len < 2)
+		return 2;
+
+	guint64 plen = buf[1] & ~WS_MASK;
+	gboolean masked = (buf[1] & WS_MASK) != 0;
+	size_t hlen = 2 + (plen == 127 ? sizeof(guint64) : plen == 126 ? sizeof(guint16) : 0) + (masked ? sizeof(guint32) : 0);
+	if (len < hlen)
+		return hlen;
+
+	const guchar *p = buf + 2;
+	if (plen == 127) {
+		guint64 v;
+		memcpy(&v, p, sizeof(v));
+		plen = GUINT64_FROM_BE(v);
+		p += sizeof(v);
+	} else if (plen == 126) {
+		guint16 v;
+		memcpy(&v, p, sizeof(v));
+		plen = GUINT16_FROM_BE(v);
+		p += sizeof(v);
+	}
+
+	frame->header = buf[0];
+	frame->masked = masked;
+	frame->mask = 0;
+	if (masked)
+		memcpy(&frame->mask, p, sizeof(frame->mask));
+	frame->len = plen;
+	return hlen;
+}
+
+typedef void (*ws_mask_func)(guchar *dst, const guchar *src, size_t len, guint32 mask);
+
+/* Portable: 8 bytes at a time, then the tail */
+static void ws_mask_scalar(guchar *dst, const guchar *src, size_t len, guint32 mask) {
+	const guchar *mb = (const guchar *)&mask;
+	guint64 m;
+	memcpy(&m, &mask, sizeof(mask));
+	memcpy((guchar *)&m + sizeof(mask), &mask, sizeof(mask));
+
+	size_t i;
+	for (i = 0; i + sizeof(m) <= len; i += sizeof(m)) {
+		guint64 v;
+		memcpy(&v, &src[i], sizeof(v));
+		v ^= m;
+		memcpy(&dst[i], &v, sizeof(v));
+	}
+	for (; i < len; i++)
+		dst[i] = src[i] ^ mb[i & 3];
+}
+
+#ifdef WS_MASK_X86
+/* The vector widths are multiples of 4, so the rest continues in phase */
+__attribute__((target("sse2")))
+static void ws_mask_sse2(guchar *dst, const guchar *src, size_t len, guint32 mask) {
+	__m128i m = _mm_set1_epi32((int)mask);
+	size_t i;
+	for (i = 0; i + sizeof(m) <= len; i += sizeof(m))
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&src[i]), m));
+	ws_mask_scalar(&dst[i], &src[i], len - i, mask);
+}
+
+__attribute__((target("avx2")))
+static void ws_mask_avx2(guchar *dst, const guchar *src, size_t len, guint32 mask) {
+	__m256i m = _mm256_set1_epi32((int)mask);
+	size_t i;
+	for (i = 0; i + sizeof(m) <= len; i += sizeof(m))
+		_mm256_storeu_si256((__m256i *)&dst[i], _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&src[i]), m));
+	/* the compiler leaves this out before the tail call, making the SSE code that follows much slower */
+	_mm256_zeroupper();
+	ws_mask_scalar(&dst[i], &src[i], len - i, mask);
+}
+#endif
+
+static ws_mask_func ws_mask_select(void) {
+#ifdef WS_MASK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return ws_mask_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return ws_mask_sse2;
+#endif
+	return ws_mask_scalar;
+}
+
+void purple_websocket_mask(guchar *dst, const guchar *src, size_t len, guint32 mask) {
+	static ws_mask_func mask_func;
+	if (!mask_func)
+		mask_func = ws_mask_select();
+	mask_func(dst, src, len, mask);
+}
@@ -0,0 +1,45 @@
+#ifndef _PURPLE_WEBSOCKET_CODEC_H_
+#define _PURPLE_WEBSOCKET_CODEC_H_
+
+#include <glib.h>
+
+/* RFC 6455 frame encoding and decoding.
+ * (This only depends on glib, so it can be built and benchmarked on its own.) */
+
+#define WS_FIN  0x80
+#define WS_RSV1 0x40
+#define WS_RSV2 0x20
+#define WS_RSV3 0x10
+#define WS_OP_MASK 0x0F
+#define WS_OP_CONT 0x00
+#define WS_OP_TEXT 0x01
+#define WS_OP_BIN  0x02
+#define WS_OP_CTRL 0x08 /* control frames: CLOS, PING, PONG */
+#define WS_OP_CLOS 0x08
+#define WS_OP_PING 0x09
+#define WS_OP_PONG 0x0A
+#define WS_MASK	0x80
+
+#define WS_HEADER_MAX 14 /* 2 + 64-bit length + mask */
+
+typedef struct _PurpleWebsocketFrame {
+	guint8 header; /* FIN, RSV and op */
+	gboolean masked;
+	guint32 mask; /* as it appears on the wire */
+	guint64 len; /* of the payload */
+} PurpleWebsocketFrame;
+
+/* Size of the header for a frame with a payload of len */
+size_t purple_websocket_frame_header_size(guint64 len, gboolean masked);
+
+/* Write the header for a frame to buf (with room for WS_HEADER_MAX), returning its size */
+size_t purple_websocket_frame_encode_header(guchar *buf, guint8 header, guint64 len, const guint32 *mask);
+
+/* Decode a frame header from the len bytes at buf.  Returns the size of the
+ * header, which is more than len (and frame is untouched) if it's incomplete. */
+size_t purple_websocket_frame_decode_header(const guchar *buf, size_t len, PurpleWebsocketFrame *frame);
+
+/* XOR len bytes of src with mask into dst (which may be the same) */
+void purple_websocket_mask(guchar *dst, const guchar *src, size_t len, guint32 mask);
+
+#endif
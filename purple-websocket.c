@@ -1,10 +1,14 @@
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
+#else
+#include <sys/uio.h>
 #endif
 
 #include <cipher.h>
@@ -12,21 +16,16 @@
 #include <sslconn.h>
 
 #include "purple-websocket.h"
+#include "purple-websocket-codec.h"
 
 static const char WS_SALT[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-#define WS_FIN  0x80
-#define WS_RSV1 0x40
-#define WS_RSV2 0x20
-#define WS_RSV3 0x10
-#define WS_OP_MASK 0x0F
-#define WS_OP_CONT 0x00
-#define WS_OP_TEXT 0x01
-#define WS_OP_BIN  0x02
-#define WS_OP_CLOS 0x08
-#define WS_OP_PING 0x09
-#define WS_OP_PONG 0x0A
-#define WS_MASK	0x80
-#define MAX_FRAG 64
+#define WS_INPUT_SIZE 4096 /* initial input buffer, and maximum response header size */
+#define WS_INPUT_IDLE (16*WS_INPUT_SIZE) /* shrink back to WS_INPUT_SIZE when empty and larger than this */
+#define WS_IOV_MAX 64 /* frames per writev */
+#define WS_DEFLATE_MIN 128 /* don't bother compressing shorter messages */
+#define WS_MESSAGE_MAX (32*1024*1024) /* largest frame, reassembled or inflated message we accept */
+
+static const guchar WS_DEFLATE_TAIL[4] = { 0x00, 0x00, 0xff, 0xff };
 
 struct buffer {
 	guchar *buf;
@@ -35,6 +34,23 @@ struct buffer {
 	gsize siz; /* allocated size of buffer */
 };
 
+/* A queued output frame (or the handshake request), ready to write */
+struct frame {
+	gsize len;
+	gboolean first; /* queued ahead of others */
+	guchar data[];
+};
+
+/* Frames are parsed in place, so the unparsed data only moves when we run
+ * out of room at the end of the buffer, and then only the partial frame */
+struct input_buffer {
+	guchar *buf;
+	gsize start; /* first unparsed byte */
+	gsize end; /* end of data read */
+	gsize want; /* bytes needed from start to make progress */
+	gsize siz; /* allocated size of buffer */
+};
+
 struct _PurpleWebsocket {
 	PurpleWebsocketCallback callback;
 	void *user_data;
@@ -45,18 +61,71 @@ struct _PurpleWebsocket {
 	PurpleSslConnection *ssl_connection;
 
 	int fd;
-	guint inpa;
+	guint inpa; /* read watcher (for plain sockets; ssl has its own) */
+	guint outpa; /* write watcher, while there is output */
 
-	struct buffer input, output;
+	struct input_buffer input;
+	GQueue output; /* of struct frame */
+	gsize output_off; /* already written from the first frame */
+	struct buffer gather; /* to write multiple frames at once over ssl */
+
+	/* frame decoder state, kept across reads */
+	struct {
+		gboolean payload; /* header decoded, waiting for the payload */
+		uint8_t header;
+		size_t len;
+	} frame;
+	uint8_t message_header; /* first frame of a fragmented message in progress, or 0 */
+	struct buffer message; /* fragments reassembled so far */
 
 	gboolean connected;
 	PurpleInputCondition closed;
+
+	/* permessage-deflate (RFC 7692), if negotiated */
+	gboolean deflate;
+	gboolean inflate_reset, deflate_reset; /* no_context_takeover */
+	int deflate_bits; /* client_max_window_bits, or 0 to send uncompressed */
+	z_stream inflate_stream, deflate_stream;
+	gboolean deflate_init;
+	struct buffer inflated;
 };
 
+/* Make room after end to read (at least) the rest of what we want */
+static void input_reserve(struct input_buffer *b) {
+	gsize have = b->end - b->start;
+	gsize need = MAX(b->want, have + 1);
+	if (b->start + need <= b->siz && b->end < b->siz)
+		return;
+
+	if (b->start) {
+		memmove(b->buf, b->buf + b->start, have);
+		b->start = 0;
+		b->end = have;
+	}
+	if (need > b->siz) {
+		gsize siz = MAX(b->siz, WS_INPUT_SIZE);
+		while (siz < need)
+			siz *= 2;
+		b->buf = g_realloc(b->buf, siz);
+		b->siz = siz;
+	}
+}
+
+/* Everything has been parsed: start over at the beginning, giving back memory after a large message */
+static void input_drained(struct input_buffer *b) {
+	b->start = b->end = 0;
+	if (b->siz > WS_INPUT_IDLE) {
+		b->buf = g_realloc(b->buf, WS_INPUT_SIZE);
+		b->siz = WS_INPUT_SIZE;
+	}
+}
+
 static void buffer_set_len(struct buffer *b, size_t n) {
 	if (n > b->siz) {
-		b->buf = g_realloc(b->buf, n);
-		b->siz = n;
+		/* grow geometrically, so appending fragments stays linear */
+		gsize siz = MAX(n, 2*b->siz);
+		b->buf = g_realloc(b->buf, siz);
+		b->siz = siz;
 	}
 	b->len = n;
 }
@@ -77,13 +146,26 @@ void purple_websocket_abort(PurpleWebsocket *ws) {
 	purple_debug_misc("websocket", "removing input %d\n", ws->inpa);
 	if (ws->inpa > 0)
 		purple_input_remove(ws->inpa);
+	if (ws->outpa > 0)
+		purple_input_remove(ws->outpa);
 
 	if (ws->fd >= 0)
 		close(ws->fd);
 
+	if (ws->deflate) {
+		inflateEnd(&ws->inflate_stream);
+		if (ws->deflate_init)
+			deflateEnd(&ws->deflate_stream);
+	}
+
 	g_free(ws->key);
-	g_free(ws->output.buf);
+	struct frame *f;
+	while ((f = g_queue_pop_head(&ws->output)))
+		g_free(f);
+	g_free(ws->gather.buf);
 	g_free(ws->input.buf);
+	g_free(ws->message.buf);
+	g_free(ws->inflated.buf);
 
 	g_free(ws);
 }
@@ -127,6 +209,110 @@ static const char *find_header_content(const char *data, const char *name) {
 	return NULL;
 }
 
+/* Accept permessage-deflate, the only extension we offer */
+static gboolean ws_read_extensions(PurpleWebsocket *ws, const char *ext) {
+	if (!(ext = skip_lws(ext)))
+		return TRUE;
+	if (g_ascii_strncasecmp(ext, "permessage-deflate", 18)) {
+		ws_error(ws, "Unsupported websocket extension");
+		return FALSE;
+	}
+	ext += 18;
+
+	ws->deflate_bits = 15;
+	while ((ext = skip_lws(ext)) && *ext == ';') {
+		ext = skip_lws(ext+1);
+		if (!ext)
+			break;
+		size_t n = strcspn(ext, " \t;,=\r\n");
+		int val = 0;
+		if (ext[n] == '=')
+			val = atoi(ext + n + 1 + (ext[n+1] == '"'));
+		if (n == 26 && !g_ascii_strncasecmp(ext, "server_no_context_takeover", n))
+			ws->inflate_reset = TRUE;
+		else if (n == 26 && !g_ascii_strncasecmp(ext, "client_no_context_takeover", n))
+			ws->deflate_reset = TRUE;
+		else if (n == 22 && !g_ascii_strncasecmp(ext, "client_max_window_bits", n)) {
+			if (val)
+				/* zlib can't do raw deflate with 8 bit windows, and 9 is more than the server agreed to inflate: don't compress then */
+				ws->deflate_bits = val > 8 ? val : 0;
+		}
+		else if (n != 22 || g_ascii_strncasecmp(ext, "server_max_window_bits", n)) {
+			ws_error(ws, "Unsupported permessage-deflate parameter");
+			return FALSE;
+		}
+		ext += strcspn(ext, ";,\r\n");
+	}
+
+	/* a larger window can always inflate smaller ones */
+	if (inflateInit2(&ws->inflate_stream, -15) != Z_OK) {
+		ws_error(ws, "Unable to initialize permessage-deflate");
+		return FALSE;
+	}
+	ws->deflate = TRUE;
+	return TRUE;
+}
+
+/* Inflate a compressed message into ws->inflated */
+static gboolean ws_inflate(PurpleWebsocket *ws, const guchar *msg, size_t len) {
+	z_stream *z = &ws->inflate_stream;
+	struct buffer *out = &ws->inflated;
+	out->len = 0;
+	for (int tail = 0; tail < 2; tail++) {
+		/* the message, followed by the (stripped) empty block */
+		z->next_in = (Bytef *)(tail ? WS_DEFLATE_TAIL : msg);
+		z->avail_in = tail ? sizeof(WS_DEFLATE_TAIL) : len;
+		int r;
+		do {
+			if (out->siz - out->len < 4096) {
+				if (out->len >= WS_MESSAGE_MAX) {
+					ws_error(ws, "Message too large");
+					return FALSE;
+				}
+				out->siz = MIN(MAX(2*out->siz, 4096), WS_MESSAGE_MAX + 4096);
+				out->buf = g_realloc(out->buf, out->siz);
+			}
+			z->next_out = out->buf + out->len;
+			z->avail_out = out->siz - out->len;
+			r = inflate(z, Z_SYNC_FLUSH);
+			out->len = out->siz - z->avail_out;
+			if (r != Z_OK && r != Z_BUF_ERROR && r != Z_STREAM_END) {
+				ws_error(ws, "Invalid compressed message");
+				return FALSE;
+			}
+		} while (r == Z_OK && (z->avail_in || !z->avail_out));
+		if (r == Z_STREAM_END) {
+			/* final block: the next message starts over */
+			inflateReset(z);
+			break;
+		}
+	}
+	if (ws->inflate_reset)
+		inflateReset(z);
+	return TRUE;
+}
+
+/* Deflate a message into out, returning the compressed length (0 to send it as is) */
+static size_t ws_deflate(PurpleWebsocket *ws, const guchar *msg, size_t len, guchar *out, size_t siz) {
+	z_stream *z = &ws->deflate_stream;
+	z->next_in = (Bytef *)msg;
+	z->avail_in = len;
+	z->next_out = out;
+	z->avail_out = siz;
+	if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in || z->avail_out < 1) {
+		/* didn't fit (or failed): send uncompressed */
+		deflateReset(z);
+		return 0;
+	}
+	size_t n = siz - z->avail_out;
+	if (ws->deflate_reset)
+		deflateReset(z);
+	/* strip the empty block at the end */
+	if (n >= 4 && !memcmp(out + n - 4, WS_DEFLATE_TAIL, 4))
+		n -= 4;
+	return n;
+}
+
 static gboolean ws_read_headers(PurpleWebsocket *ws, const char *headers) {
 	const char *upgrade = skip_lws(find_header_content(headers, "Upgrade"));
 	if (upgrade && (g_ascii_strncasecmp(upgrade, "websocket", 9) || skip_lws(upgrade+9)))
@@ -155,169 +341,240 @@ static gboolean ws_read_headers(PurpleWebsocket *ws, const char *headers) {
 		g_free(b);
 	}
 
-	/* TODO: Sec-WebSocket-Extensions, Sec-WebSocket-Protocol */
+	/* TODO: Sec-WebSocket-Protocol */
 
 	if (strncmp(headers, "HTTP/1.1 101 ", 13) || !upgrade || !connection || !accept) {
 		ws_error(ws, headers);
 		return FALSE;
 	}
 
+	if (!ws_read_extensions(ws, find_header_content(headers, "Sec-WebSocket-Extensions")))
+		return FALSE;
+
 	ws->connected = TRUE;
 	ws->callback(ws, ws->user_data, PURPLE_WEBSOCKET_OPEN, NULL, 0);
 	return TRUE;
 }
 
-static size_t ws_read_message(PurpleWebsocket *ws) {
-	uint8_t *input = ws->input.buf;
-	size_t len = ws->input.off;
-	size_t off = 0;
-	struct {
-		guchar *p;
-		size_t l;
-	} frag[MAX_FRAG];
-	unsigned fi;
-
-	for (fi = 0; fi < MAX_FRAG; fi ++) {
-#define GETN(N) ({ \
-		if (len-off < (N)) \
-			return off+N; \
-		uint8_t *_p = &input[off]; \
-		off += N; \
-		_p; \
-	})
-#define GETB(T) (*(uint8_t*)GETN(1))
-#define GET(V) memcpy(&(V), GETN(sizeof(V)), sizeof(V))
-
-		if (len-off < 2)
-			return off+2;
-		uint8_t header = GETB(uint8_t);
-		if (header & ~(WS_OP_MASK|WS_FIN)) {
-			ws_error(ws, "Unsupported RSV flag");
-			return 0;
-		}
-		uint8_t mlen = GETB(uint8_t);
-		if (mlen & WS_MASK) {
-			ws_error(ws, "Masked frame");
-			return 0;
-		}
-		uint64_t plen = mlen & ~WS_MASK;
-		uint16_t tlen;
-		switch (plen) {
-			case 127:
-				GET(plen);
-				plen = GUINT64_FROM_BE(plen);
-				break;
-			case 126:
-				GET(tlen);
-				plen = GUINT16_FROM_BE(tlen);
-				break;
-		}
-		frag[fi].l = plen;
-		frag[fi].p = GETN(plen);
-	
-#undef GET
-#undef GETB
-#undef GETN
-
-		if (header & WS_FIN) {
-			/* consolidate all the fragments after the first */
-			unsigned i;
-			for (i = 1; i <= fi; i++) {
-				memmove(&frag[0].p[frag[0].l], frag[i].p, frag[i].l);
-				frag[0].l += frag[i].l;
+/* Deliver a complete message or control frame, returning FALSE if ws is gone */
+static gboolean ws_read_message(PurpleWebsocket *ws, uint8_t header, guchar *msg, size_t len) {
+	purple_debug_misc("websocket", "message %x len %lu\n", header, (unsigned long) len);
+	uint8_t op = header & WS_OP_MASK;
+	switch (op) {
+		case WS_OP_TEXT:
+		case WS_OP_BIN:
+			if (header & WS_RSV1) {
+				if (!ws_inflate(ws, msg, len))
+					return FALSE;
+				msg = ws->inflated.buf;
+				len = ws->inflated.len;
 			}
-
-			purple_debug_misc("websocket", "message %x len %lu\n", input[0], (unsigned long) frag[0].l);
-			uint8_t op = input[0] & WS_OP_MASK;
-			switch (op) {
-				case WS_OP_TEXT:
-				case WS_OP_BIN:
-				case WS_OP_PONG:
-				case WS_OP_CLOS:
-					ws->callback(ws, ws->user_data, (PurpleWebsocketOp)op, frag[0].p, frag[0].l);
-					if (op == WS_OP_CLOS) {
-						ws->closed |= PURPLE_INPUT_READ;
-						if (ws->closed & PURPLE_INPUT_WRITE) {
-							purple_websocket_abort(ws);
-							return 0;
-						} else
-							purple_websocket_send(ws, PURPLE_WEBSOCKET_CLOSE, NULL, 0);
-					}
-					break;
-				case WS_OP_PING:
-					purple_websocket_send(ws, PURPLE_WEBSOCKET_PONG, frag[0].p, frag[0].l);
-					break;
-				default:
-					ws_error(ws, "Unknown frame op");
+		case WS_OP_PONG:
+		case WS_OP_CLOS:
+			ws->callback(ws, ws->user_data, (PurpleWebsocketOp)op, msg, len);
+			if (op == WS_OP_CLOS) {
+				ws->closed |= PURPLE_INPUT_READ;
+				if (ws->closed & PURPLE_INPUT_WRITE) {
+					purple_websocket_abort(ws);
+					return FALSE;
+				} else
+					purple_websocket_send(ws, PURPLE_WEBSOCKET_CLOSE, NULL, 0);
 			}
-			return off;
-		}
+			return TRUE;
+		case WS_OP_PING:
+			purple_websocket_send(ws, PURPLE_WEBSOCKET_PONG, msg, len);
+			return TRUE;
+		default:
+			ws_error(ws, "Unknown frame op");
+			return FALSE;
 	}
-
-	ws_error(ws, "Maximum fragment count exceeded");
-	return 0;
 }
 
-static void ws_input_cb(gpointer data, gint source, PurpleInputCondition cond);
+/* Decode a frame header from the input */
+static gboolean ws_read_frame_header(PurpleWebsocket *ws) {
+	struct input_buffer *in = &ws->input;
+	PurpleWebsocketFrame frame;
+	size_t hlen = purple_websocket_frame_decode_header(in->buf + in->start, in->end - in->start, &frame);
+	if (hlen > in->end - in->start) {
+		in->want = hlen;
+		return TRUE;
+	}
 
-static gboolean ws_input(PurpleWebsocket *ws) {
-	if (ws->inpa) {
-		purple_input_remove(ws->inpa);
-		ws->inpa = 0;
+	uint8_t header = frame.header;
+	uint8_t op = header & WS_OP_MASK;
+	uint8_t rsv = WS_RSV1|WS_RSV2|WS_RSV3;
+	if (ws->deflate && (op == WS_OP_TEXT || op == WS_OP_BIN))
+		/* compressed message */
+		rsv &= ~WS_RSV1;
+	if (header & rsv) {
+		ws_error(ws, "Unsupported RSV flag");
+		return FALSE;
 	}
+	if (frame.masked) {
+		ws_error(ws, "Masked frame");
+		return FALSE;
+	}
+	if (op & WS_OP_CTRL) {
+		/* may come between fragments, but can't be fragmented themselves */
+		if (!(header & WS_FIN) || frame.len > 125) {
+			ws_error(ws, "Invalid control frame");
+			return FALSE;
+		}
+	} else if (!op != !!ws->message_header) {
+		ws_error(ws, op ? "Expected continuation frame" : "Unexpected continuation frame");
+		return FALSE;
+	}
+	if (frame.len > WS_MESSAGE_MAX) {
+		ws_error(ws, "Frame too large");
+		return FALSE;
+	}
+	if (!op && ws->message.len + frame.len > WS_MESSAGE_MAX) {
+		/* continuing a fragmented message */
+		ws_error(ws, "Message too large");
+		return FALSE;
+	}
+	size_t plen = frame.len;
+
+	in->start += hlen;
+	in->want = plen;
+	ws->frame.payload = TRUE;
+	ws->frame.header = header;
+	ws->frame.len = plen;
+	return TRUE;
+}
 
-	if (ws->output.off) {
-		/* always none left in practice: */
-		memmove(ws->output.buf, ws->output.buf + ws->output.off, ws->output.len -= ws->output.off);
-		ws->output.off = 0;
+/* Decode the frame payload from the input, now that it's all there */
+static gboolean ws_read_frame_payload(PurpleWebsocket *ws) {
+	struct input_buffer *in = &ws->input;
+	guchar *p = in->buf + in->start;
+	size_t len = ws->frame.len;
+	uint8_t header = ws->frame.header;
+
+	/* consume it now, in case we go away in a callback: it stays put until the next read */
+	in->start += len;
+	in->want = 2;
+	ws->frame.payload = FALSE;
+
+	if (header & WS_OP_CTRL)
+		return ws_read_message(ws, header, p, len);
+
+	if (header & WS_OP_MASK) {
+		if (header & WS_FIN)
+			/* the usual case: deliver in place */
+			return ws_read_message(ws, header, p, len);
+		ws->message_header = header;
+		ws->message.len = 0;
 	}
 
-	PurpleInputCondition cond = (ws->ssl_connection ? 0 : PURPLE_INPUT_READ); /* permanent purple_ssl_input_add for ssl */
+	memcpy(buffer_incr(&ws->message, len), p, len);
+	if (!(header & WS_FIN))
+		return TRUE;
 
-	if (ws->output.len)
-		cond |= PURPLE_INPUT_WRITE;
-	else if (ws->closed & PURPLE_INPUT_READ) {
-		purple_websocket_abort(ws);
+	header = ws->message_header;
+	ws->message_header = 0;
+	if (!ws_read_message(ws, header, ws->message.buf, ws->message.len))
 		return FALSE;
+	if (ws->message.siz > WS_INPUT_IDLE) {
+		g_free(ws->message.buf);
+		memset(&ws->message, 0, sizeof(ws->message));
 	}
-
-	if (cond)
-		ws->inpa = purple_input_add(ws->fd, cond, ws_input_cb, ws);
 	return TRUE;
 }
 
-static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCondition cond) {
-	PurpleWebsocket *ws = data;
+static void ws_input_cb(gpointer data, gint source, PurpleInputCondition cond);
 
-	if (cond & PURPLE_INPUT_WRITE) {
-		ssize_t len = ws->output.off >= ws->output.len ? 0 :
-			ws->ssl_connection
-			? (ssize_t)purple_ssl_write(ws->ssl_connection, ws->output.buf + ws->output.off, ws->output.len - ws->output.off)
-			: write(ws->fd, ws->output.buf + ws->output.off, ws->output.len - ws->output.off);
+/* Watch for writability while there's output, and finish closing once there's not */
+static gboolean ws_output(PurpleWebsocket *ws) {
+	if (!g_queue_is_empty(&ws->output)) {
+		if (!ws->outpa && ws->fd >= 0)
+			ws->outpa = purple_input_add(ws->fd, PURPLE_INPUT_WRITE, ws_input_cb, ws);
+		return TRUE;
+	}
 
-		if (len < 0) {
-			if (errno != EAGAIN) {
-				ws_error(ws, g_strerror(errno));
-				return;
+	if (ws->outpa) {
+		purple_input_remove(ws->outpa);
+		ws->outpa = 0;
+	}
+	if (ws->closed & PURPLE_INPUT_READ) {
+		purple_websocket_abort(ws);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Write as much of the queued output as we can in one go */
+static gboolean ws_write(PurpleWebsocket *ws) {
+	struct frame *f = g_queue_peek_head(&ws->output);
+	ssize_t len;
+	if (!f)
+		return ws_output(ws);
+
+#ifndef _WIN32
+	if (!ws->ssl_connection) {
+		struct iovec iov[WS_IOV_MAX];
+		int n = 0;
+		GList *l;
+		for (l = ws->output.head; l && n < WS_IOV_MAX; l = l->next, n++) {
+			f = l->data;
+			iov[n].iov_base = f->data;
+			iov[n].iov_len = f->len;
+		}
+		iov[0].iov_base = (guchar *)iov[0].iov_base + ws->output_off;
+		iov[0].iov_len -= ws->output_off;
+		len = writev(ws->fd, iov, n);
+	} else
+#endif
+	{
+		const guchar *buf = f->data + ws->output_off;
+		gsize siz = f->len - ws->output_off;
+		if (ws->output.length > 1) {
+			/* ssl records (and syscalls) are expensive, so coalesce everything */
+			GList *l;
+			ws->gather.len = 0;
+			memcpy(buffer_incr(&ws->gather, siz), buf, siz);
+			for (l = ws->output.head->next; l; l = l->next) {
+				f = l->data;
+				memcpy(buffer_incr(&ws->gather, f->len), f->data, f->len);
 			}
-		} else if ((ws->output.off += len) >= ws->output.len) {
-			g_assert(ws->output.off == ws->output.len);
-			if (!ws_input(ws))
-				return;
+			buf = ws->gather.buf;
+			siz = ws->gather.len;
 		}
+		len = ws->ssl_connection
+			? (ssize_t)purple_ssl_write(ws->ssl_connection, buf, siz)
+			: write(ws->fd, buf, siz);
+	}
+
+	if (len < 0) {
+		if (errno == EAGAIN)
+			return TRUE;
+		ws_error(ws, g_strerror(errno));
+		return FALSE;
+	}
 
-		/*
-		gchar *enc = purple_base16_encode(ws->output.buf + ws->output.off, len);
-		purple_debug_misc("websocket", "send: %s\n", enc);
-		g_free(enc);
-		*/
+	ws->output_off += len;
+	while ((f = g_queue_peek_head(&ws->output)) && ws->output_off >= f->len) {
+		ws->output_off -= f->len;
+		g_free(g_queue_pop_head(&ws->output));
 	}
+	if (ws->gather.siz > WS_INPUT_IDLE) {
+		g_free(ws->gather.buf);
+		memset(&ws->gather, 0, sizeof(ws->gather));
+	}
+	return ws_output(ws);
+}
+
+static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCondition cond) {
+	PurpleWebsocket *ws = data;
+
+	if (cond & PURPLE_INPUT_WRITE)
+		if (!ws_write(ws))
+			return;
 
 	while (cond & PURPLE_INPUT_READ) {
-		g_return_if_fail(ws->input.off < ws->input.len);
+		input_reserve(&ws->input);
 		ssize_t len = ws->ssl_connection
-			? (ssize_t)purple_ssl_read(ws->ssl_connection, ws->input.buf + ws->input.off, ws->input.siz - ws->input.off)
-			: read(ws->fd, ws->input.buf + ws->input.off, ws->input.siz - ws->input.off);
+			? (ssize_t)purple_ssl_read(ws->ssl_connection, ws->input.buf + ws->input.end, ws->input.siz - ws->input.end)
+			: read(ws->fd, ws->input.buf + ws->input.end, ws->input.siz - ws->input.end);
 
 		if (len < 0) {
 			if (errno != EAGAIN) {
@@ -331,20 +588,20 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 			return;
 		} else {
 			/*
-			gchar *enc = purple_base16_encode(ws->input.buf + ws->input.off, len);
-			purple_debug_misc("websocket", "recv %zu/%zu: %s\n", ws->input.off+len, ws->input.len, enc);
+			gchar *enc = purple_base16_encode(ws->input.buf + ws->input.end, len);
+			purple_debug_misc("websocket", "recv %zu/%zu: %s\n", ws->input.end+len, ws->input.want, enc);
 			g_free(enc);
 			*/
 
-			ws->input.off += len;
+			ws->input.end += len;
 
 			if (!ws->connected) {
 				/* search for the end of headers in the new block (backing up 4-1) */
 				char *resp = (char *)ws->input.buf;
 				int backup = len + 3;
-				if (backup > ws->input.off)
-					backup = ws->input.off;
-				char *eoh = g_strstr_len(resp + ws->input.off - backup, backup, "\r\n\r\n");
+				if (backup > ws->input.end)
+					backup = ws->input.end;
+				char *eoh = g_strstr_len(resp + ws->input.end - backup, backup, "\r\n\r\n");
 
 				if (eoh) {
 					/* got all the headers now */
@@ -353,76 +610,83 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 					if (!ws_read_headers(ws, resp))
 						return;
 
-					memmove(ws->input.buf, eoh, ws->input.off -= eoh - resp);
-					ws->input.len = 2;
+					ws->input.start = (guchar *)eoh - ws->input.buf;
+					ws->input.want = 2;
 				}
-				else if (ws->input.off >= ws->input.len) {
+				else if (ws->input.end >= WS_INPUT_SIZE) {
 					ws_error(ws, "Response headers too long");
 					return;
 				}
 				else
-					return;
+					continue;
 			}
-			
-			while (ws->input.off >= ws->input.len) {
-				size_t r = ws_read_message(ws);
-				if (!r) /* error */
+
+			while (ws->input.end - ws->input.start >= ws->input.want)
+				if (!(ws->frame.payload ? ws_read_frame_payload(ws) : ws_read_frame_header(ws)))
 					return;
-				else if (r > ws->input.off) {
-					/* need more */
-					buffer_set_len(&ws->input, r);
-				} else {
-					/* consumed some */
-					memmove(ws->input.buf, ws->input.buf + r, ws->input.off -= r);
-					ws->input.len = 2;
-				}
-			}
+			if (ws->input.start == ws->input.end)
+				input_drained(&ws->input);
 		}
 	}
 }
 
-void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len) {
+static void ws_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len, gboolean first) {
 	g_return_if_fail(ws->connected && !(ws->closed & PURPLE_INPUT_WRITE));
 	g_return_if_fail(!(op & ~WS_OP_MASK));
-	gboolean buf = ws->output.len;
-
-#define ADDB(V) (*(uint8_t*)buffer_incr(&ws->output, 1) = (V))
-#define ADD(T, V) ({ \
-		T _v = (V); \
-		memcpy(buffer_incr(&ws->output, sizeof(T)), &_v, sizeof(T)); \
-	})
 
-	ADDB(WS_FIN | op);
-	if (len > UINT16_MAX) {
-		ADDB(WS_MASK | 127);
-		ADD(uint64_t, GUINT64_TO_BE(len));
-	} else if (len >= 126) {
-		ADDB(WS_MASK | 126);
-		ADD(uint16_t, GUINT16_TO_BE(len));
-	} else {
-		ADDB(WS_MASK | len);
+	uint8_t rsv = 0;
+	guchar *compressed = NULL;
+	/* compressed frames must stay in order, so those that jump the queue aren't */
+	if (ws->deflate && ws->deflate_bits && !first && (op == PURPLE_WEBSOCKET_TEXT || op == PURPLE_WEBSOCKET_BINARY) && len >= WS_DEFLATE_MIN) {
+		if (!ws->deflate_init)
+			ws->deflate_init = deflateInit2(&ws->deflate_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -ws->deflate_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		if (ws->deflate_init) {
+			size_t siz = len;
+			compressed = g_malloc(siz);
+			size_t clen = ws_deflate(ws, msg, len, compressed, siz);
+			if (clen) {
+				rsv = WS_RSV1;
+				msg = compressed;
+				len = clen;
+			}
+		}
 	}
 
 	uint32_t mask = g_random_int();
-	ADD(uint32_t, mask);
-
-#undef ADD
-#undef ADDB
-
-	guchar *p = buffer_incr(&ws->output, len);
-	size_t i;
-	for (i = 0; i+3 < len; i+=4) {
-		uint32_t m = *(uint32_t*)&msg[i] ^ mask;
-		memcpy(&p[i], &m, 4);
-	}
-	for (; i < len; i++)
-		p[i] = msg[i] ^ ((uint8_t*)&mask)[i&3];
+	size_t hlen = purple_websocket_frame_header_size(len, TRUE);
+	struct frame *f = g_malloc(sizeof(struct frame) + hlen + len);
+	f->len = hlen + len;
+	f->first = first;
+	purple_websocket_frame_encode_header(f->data, WS_FIN | rsv | op, len, &mask);
+	purple_websocket_mask(f->data + hlen, msg, len, mask);
+	g_free(compressed);
 
 	if (op == PURPLE_WEBSOCKET_CLOSE)
 		ws->closed |= PURPLE_INPUT_WRITE;
 
-	if (!buf)
-		ws_input(ws);
+	/* written out once the socket's writable, along with anything else sent by then */
+	if (first) {
+		/* behind any frame partly written and others sent first, in order */
+		GList *l = ws->output.head;
+		if (l && ws->output_off)
+			l = l->next;
+		while (l && ((struct frame *)l->data)->first)
+			l = l->next;
+		if (l)
+			g_queue_insert_before(&ws->output, l, f);
+		else
+			g_queue_push_tail(&ws->output, f);
+	} else
+		g_queue_push_tail(&ws->output, f);
+	ws_output(ws);
+}
+
+void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len) {
+	ws_send(ws, op, msg, len, FALSE);
+}
+
+void purple_websocket_send_first(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len) {
+	ws_send(ws, op, msg, len, TRUE);
 }
 
 static void wss_input_cb(gpointer data, G_GNUC_UNUSED PurpleSslConnection *ssl_connection, PurpleInputCondition cond)
@@ -437,8 +701,7 @@ static void wss_connect_cb(gpointer data, PurpleSslConnection *ssl_connection, G
 	ws->fd = ssl_connection->fd;
 	purple_ssl_input_add(ws->ssl_connection, wss_input_cb, ws);
 
-	if (ws_input(ws))
-		ws_input_cb(ws, ws->fd, PURPLE_INPUT_WRITE);
+	ws_write(ws);
 }
 
 static void wss_error_cb(G_GNUC_UNUSED PurpleSslConnection *ssl_connection, PurpleSslErrorType error, gpointer data) {
@@ -457,9 +720,9 @@ static void ws_connect_cb(gpointer data, gint source, const gchar *error_message
 	}
 
 	ws->fd = source;
+	ws->inpa = purple_input_add(ws->fd, PURPLE_INPUT_READ, ws_input_cb, ws);
 
-	if (ws_input(ws))
-		ws_input_cb(ws, ws->fd, PURPLE_INPUT_WRITE);
+	ws_write(ws);
 }
 
 PurpleWebsocket *purple_websocket_connect(PurpleAccount *account,
@@ -512,19 +775,23 @@ Host: %s\r\n\
 Connection: Upgrade\r\n\
 Upgrade: websocket\r\n\
 Sec-WebSocket-Key: %s\r\n\
-Sec-WebSocket-Version: 13\r\n", path, host, ws->key);
+Sec-WebSocket-Version: 13\r\n\
+Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n", path, host, ws->key);
 		if (protocol)
 			g_string_append_printf(request, "Sec-WebSocket-Protocol: %s\r\n", protocol);
 		if (cookies)
 			g_string_append_printf(request, "Cookie: %s\r\n", cookies);
 		g_string_append(request, "\r\n");
 
-		ws->output.len = request->len;
-		ws->output.siz = request->allocated_len;
-		ws->output.buf = (guchar *)g_string_free(request, FALSE);
+		struct frame *f = g_malloc(sizeof(struct frame) + request->len);
+		f->len = request->len;
+		f->first = FALSE;
+		memcpy(f->data, request->str, request->len);
+		g_queue_push_tail(&ws->output, f);
+		g_string_free(request, TRUE);
 
-		/* allocate space for responses (headers) */
-		buffer_set_len(&ws->input, 4096);
+		/* space for responses (headers) */
+		ws->input.want = WS_INPUT_SIZE;
 
 		if (ssl)
 			ws->ssl_connection = purple_ssl_connect(account, host, port,
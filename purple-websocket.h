@@ -19,6 +19,8 @@ typedef void (*PurpleWebsocketCallback)(PurpleWebsocket *ws, gpointer user_data,
 
 PurpleWebsocket *purple_websocket_connect(PurpleAccount *account, const char *url, const char *protocol, const char *cookies, PurpleWebsocketCallback callback, void *user_data);
 void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len);
+/* Send ahead of anything queued but not yet started (in order with other such frames), for replies that can't wait */
+void purple_websocket_send_first(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len);
 void purple_websocket_abort(PurpleWebsocket *ws);
 
 #endif
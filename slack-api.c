@@ -1,7 +1,16 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
 #include <debug.h>
+#include <proxy.h>
+#include <sslconn.h>
 
 #include "slack-api.h"
 #include "slack-json.h"
+#include "slack-request.h"
+#include "slack-trace.h"
 #include "slack-channel.h"
 #include "slack-user.h"
 
@@ -14,12 +23,340 @@ PurpleConnectionError slack_api_connection_error(const gchar *error) {
 	return PURPLE_CONNECTION_ERROR_NETWORK_ERROR;
 }
 
+/* Slack rate limit tiers: https://api.slack.com/docs/rate-limits */
+typedef enum {
+	SLACK_TIER_1,
+	SLACK_TIER_2,
+	SLACK_TIER_3,
+	SLACK_TIER_4,
+	SLACK_TIER_SPECIAL,
+	SLACK_TIER_CONNECTIONS,
+	SLACK_TIER_COUNT
+} SlackAPITier;
+
+static const struct api_tier {
+	unsigned per_minute; /* sustained rate */
+	unsigned burst; /* bucket size */
+} api_tiers[SLACK_TIER_COUNT] = {
+	[SLACK_TIER_1]		= {   1,  1 },
+	[SLACK_TIER_2]		= {  20,  5 },
+	[SLACK_TIER_3]		= {  50, 10 },
+	[SLACK_TIER_4]		= { 100, 20 },
+	/* chat.postMessage: roughly 1 per second per channel, with bursts */
+	[SLACK_TIER_SPECIAL]	= {  60, 10 },
+	/* apps.connections.open: login, every Socket Mode connection, and handovers that must finish within slack's warning */
+	[SLACK_TIER_CONNECTIONS]	= {  20, 16 },
+};
+
+/* sorted by name for bsearch; anything not listed is SLACK_TIER_3 */
+static const struct api_endpoint {
+	const char *name;
+	SlackAPITier tier;
+	SlackAPIPriority priority; /* SLACK_API_DEFAULT: depends on whether we're still logging in */
+	unsigned ttl; /* seconds successful responses may be cached for */
+	gboolean once; /* not idempotent: never resent, or pipelined behind other calls */
+	gboolean changes; /* changes the channel it's given, so its cached info is stale */
+} api_endpoints[] = {
+	{ "apps.connections.open",	SLACK_TIER_CONNECTIONS,	SLACK_API_INTERACTIVE },
+	{ "auth.test",			SLACK_TIER_SPECIAL,	SLACK_API_DEFAULT },
+	{ "chat.command",		SLACK_TIER_3,		SLACK_API_INTERACTIVE,	0,	TRUE },
+	{ "chat.delete",		SLACK_TIER_3,		SLACK_API_INTERACTIVE,	0,	TRUE },
+	{ "chat.postMessage",		SLACK_TIER_SPECIAL,	SLACK_API_INTERACTIVE,	0,	TRUE },
+	{ "chat.update",		SLACK_TIER_3,		SLACK_API_INTERACTIVE,	0,	TRUE },
+	{ "conversations.info",		SLACK_TIER_3,		SLACK_API_DEFAULT,	60 },
+	{ "conversations.invite",	SLACK_TIER_3,		SLACK_API_DEFAULT,	0,	FALSE,	TRUE },
+	{ "conversations.join",		SLACK_TIER_3,		SLACK_API_INTERACTIVE,	0,	FALSE,	TRUE },
+	{ "conversations.list",		SLACK_TIER_2,		SLACK_API_DEFAULT },
+	{ "conversations.mark",		SLACK_TIER_3,		SLACK_API_DEFAULT,	0,	FALSE,	TRUE },
+	{ "conversations.members",	SLACK_TIER_4,		SLACK_API_DEFAULT },
+	{ "conversations.open",		SLACK_TIER_3,		SLACK_API_INTERACTIVE,	0,	FALSE,	TRUE },
+	{ "conversations.setTopic",	SLACK_TIER_2,		SLACK_API_DEFAULT,	0,	FALSE,	TRUE },
+	{ "users.info",			SLACK_TIER_4,		SLACK_API_DEFAULT,	600 },
+	{ "users.list",			SLACK_TIER_2,		SLACK_API_DEFAULT },
+	{ "users.setPresence",		SLACK_TIER_2,		SLACK_API_DEFAULT },
+};
+
+static int api_endpoint_cmp(const void *name, const void *endpoint) {
+	return strcmp(name, ((const struct api_endpoint *)endpoint)->name);
+}
+
+static const struct api_endpoint *api_endpoint(const char *endpoint) {
+	return bsearch(endpoint, api_endpoints, G_N_ELEMENTS(api_endpoints), sizeof(*api_endpoints), api_endpoint_cmp);
+}
+
+static gboolean api_endpoint_once(const char *endpoint) {
+	const struct api_endpoint *e = api_endpoint(endpoint);
+	return e && e->once;
+}
+
+static SlackAPITier api_endpoint_tier(const char *endpoint) {
+	const struct api_endpoint *e = api_endpoint(endpoint);
+	return e ? e->tier : SLACK_TIER_3;
+}
+
+/* Resolve SLACK_API_DEFAULT: sends are interactive, anything else is part of login until we're connected, and background after */
+static SlackAPIPriority api_endpoint_priority(SlackAccount *sa, const char *endpoint, SlackAPIPriority priority) {
+	if (priority != SLACK_API_DEFAULT)
+		return priority;
+	const struct api_endpoint *e = api_endpoint(endpoint);
+	if (e && e->priority != SLACK_API_DEFAULT)
+		return e->priority;
+	if (purple_connection_get_state(sa->gc) != PURPLE_CONNECTED)
+		return SLACK_API_LOGIN;
+	return SLACK_API_BACKGROUND;
+}
+
+struct _SlackAPILimits {
+	struct api_bucket {
+		double tokens;
+		gint64 updated; /* monotonic time tokens was last computed */
+		gint64 paused; /* monotonic time until which this tier is ratelimited */
+	} bucket[SLACK_TIER_COUNT];
+	guint wake_timer; /* for the next token to become available */
+};
+
+/* Take a token from the bucket if one is available, otherwise set *wait to how long until there will be */
+static gboolean api_bucket_take(struct api_bucket *b, SlackAPITier tier, gint64 now, gint64 *wait) {
+	const struct api_tier *t = &api_tiers[tier];
+	if (b->paused > now) {
+		*wait = b->paused - now;
+		return FALSE;
+	}
+	if (b->updated)
+		b->tokens = MIN(t->burst, b->tokens + (double)(now - b->updated) * t->per_minute / (60 * G_USEC_PER_SEC));
+	else
+		b->tokens = t->burst;
+	b->updated = now;
+	if (b->tokens >= 1) {
+		b->tokens -= 1;
+		return TRUE;
+	}
+	*wait = (1 - b->tokens) * (60 * G_USEC_PER_SEC) / t->per_minute;
+	return FALSE;
+}
+
+/* Cached responses, in the LRU order of sa->api_cache_lru, and indexed by the ids they're about in sa->api_cache_ids */
+#define API_CACHE_MAX	256
+
+struct api_cache_entry {
+	char *key; /* endpoint?param=value&... */
+	char **ids; /* channel and user values in key */
+	char *body;
+	gsize len;
+	gint64 expires; /* monotonic time */
+	GList link;
+};
+
+static void api_cache_index(SlackAccount *sa, const char *id, struct api_cache_entry *entry, gboolean add) {
+	GList *l = g_hash_table_lookup(sa->api_cache_ids, id);
+	l = add ? g_list_prepend(l, entry) : g_list_remove(l, entry);
+	if (l)
+		g_hash_table_insert(sa->api_cache_ids, g_strdup(id), l);
+	else
+		g_hash_table_remove(sa->api_cache_ids, id);
+}
+
+/* The values of the id parameters in key */
+static char **api_cache_key_ids(const char *key) {
+	GPtrArray *ids = g_ptr_array_new();
+	const char *p = strchr(key, '?');
+	while (p++) {
+		const char *end = strchr(p, '&') ?: p + strlen(p);
+		const char *eq = memchr(p, '=', end - p);
+		if (eq && eq + 1 < end && ((eq - p == 7 && !strncmp(p, "channel", 7)) || (eq - p == 4 && !strncmp(p, "user", 4))))
+			g_ptr_array_add(ids, g_strndup(eq + 1, end - eq - 1));
+		p = *end ? end : NULL;
+	}
+	g_ptr_array_add(ids, NULL);
+	return (char **)g_ptr_array_free(ids, FALSE);
+}
+
+static void api_cache_remove(SlackAccount *sa, struct api_cache_entry *entry) {
+	g_queue_unlink(&sa->api_cache_lru, &entry->link);
+	g_hash_table_remove(sa->api_cache, entry->key);
+	for (char **id = entry->ids; *id; id++)
+		api_cache_index(sa, *id, entry, FALSE);
+	g_strfreev(entry->ids);
+	g_free(entry->key);
+	g_free(entry->body);
+	g_free(entry);
+}
+
+/* Returns a still valid response for key, if any */
+static struct api_cache_entry *api_cache_lookup(SlackAccount *sa, const char *key) {
+	struct api_cache_entry *entry = g_hash_table_lookup(sa->api_cache, key);
+	if (!entry)
+		return NULL;
+	if (entry->expires <= g_get_monotonic_time()) {
+		api_cache_remove(sa, entry);
+		return NULL;
+	}
+	g_queue_unlink(&sa->api_cache_lru, &entry->link);
+	g_queue_push_head_link(&sa->api_cache_lru, &entry->link);
+	return entry;
+}
+
+static void api_cache_store(SlackAccount *sa, const char *key, unsigned ttl, const char *body, gsize len) {
+	struct api_cache_entry *entry = g_hash_table_lookup(sa->api_cache, key);
+	if (entry)
+		api_cache_remove(sa, entry);
+
+	entry = g_new0(struct api_cache_entry, 1);
+	entry->key = g_strdup(key);
+	entry->ids = api_cache_key_ids(key);
+	entry->body = g_strndup(body, len);
+	entry->len = len;
+	entry->expires = g_get_monotonic_time() + (gint64)ttl * G_USEC_PER_SEC;
+	entry->link.data = entry;
+	g_hash_table_insert(sa->api_cache, entry->key, entry);
+	g_queue_push_head_link(&sa->api_cache_lru, &entry->link);
+	for (char **id = entry->ids; *id; id++)
+		api_cache_index(sa, *id, entry, TRUE);
+
+	while (sa->api_cache_lru.length > API_CACHE_MAX)
+		api_cache_remove(sa, sa->api_cache_lru.tail->data);
+}
+
+void slack_api_cache_invalidate(SlackAccount *sa, const char *id) {
+	if (!id || !*id)
+		return;
+	GList *l;
+	/* each removal drops it from the list */
+	while ((l = g_hash_table_lookup(sa->api_cache_ids, id)))
+		api_cache_remove(sa, l->data);
+}
+
+static void api_cache_clear(SlackAccount *sa) {
+	while (sa->api_cache_lru.head)
+		api_cache_remove(sa, sa->api_cache_lru.head->data);
+}
+
+/* Per-endpoint statistics, for /slackstats */
+#define API_HIST_BUCKETS	16 /* milliseconds: 0, 1, 2-3, 4-7, ..., 16384+ */
+
+struct api_hist {
+	guint64 count;
+	guint64 total; /* microseconds */
+	guint64 max;
+	guint64 bucket[API_HIST_BUCKETS];
+};
+
+struct api_stats {
+	guint64 calls; /* completed */
+	guint64 errors;
+	guint64 ratelimited;
+	guint64 cached;
+	guint64 bytes_out, bytes_in;
+	struct api_hist wait; /* queued until sent */
+	struct api_hist ttfb; /* sent until first byte of response */
+	struct api_hist time; /* queued until done */
+};
+
+struct _SlackAPIStats {
+	GHashTable *endpoints; /* char *endpoint -> struct api_stats */
+	guint max_queued;
+};
+
+static struct api_stats *api_stats_get(SlackAccount *sa, const char *endpoint) {
+	if (!sa->api_stats) {
+		sa->api_stats = g_new0(SlackAPIStats, 1);
+		sa->api_stats->endpoints = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	}
+	struct api_stats *stats = g_hash_table_lookup(sa->api_stats->endpoints, endpoint);
+	if (!stats) {
+		stats = g_new0(struct api_stats, 1);
+		g_hash_table_insert(sa->api_stats->endpoints, g_strdup(endpoint), stats);
+	}
+	return stats;
+}
+
+static void api_hist_add(struct api_hist *h, gint64 usec) {
+	if (usec < 0)
+		return;
+	h->count++;
+	h->total += usec;
+	if ((guint64)usec > h->max)
+		h->max = usec;
+	guint64 ms = usec / 1000;
+	unsigned b = 0;
+	while (ms && b < API_HIST_BUCKETS-1) {
+		ms >>= 1;
+		b++;
+	}
+	h->bucket[b]++;
+}
+
+/* Upper bound (ms) of the bucket containing the given fraction of samples */
+static guint64 api_hist_percentile(const struct api_hist *h, double q) {
+	guint64 n = 0, want = h->count * q;
+	for (unsigned b = 0; b < API_HIST_BUCKETS-1; b++)
+		if ((n += h->bucket[b]) > want)
+			return b ? (1 << b) - 1 : 0;
+	return h->max / 1000;
+}
+
+static void api_hist_print(GString *out, const char *name, const struct api_hist *h) {
+	if (!h->count)
+		return;
+	g_string_append_printf(out, " %s avg %" G_GUINT64_FORMAT " p50 %" G_GUINT64_FORMAT " p90 %" G_GUINT64_FORMAT " p99 %" G_GUINT64_FORMAT " max %" G_GUINT64_FORMAT "ms;",
+			name, h->total / h->count / 1000, api_hist_percentile(h, 0.5), api_hist_percentile(h, 0.9), api_hist_percentile(h, 0.99), h->max / 1000);
+}
+
+static gint api_stats_cmp(gconstpointer a, gconstpointer b) {
+	return strcmp(a, b);
+}
+
+GString *slack_api_stats(SlackAccount *sa) {
+	GString *out = g_string_new(NULL);
+	g_string_append_printf(out, "API calls: %u queued, %u running, %u connections",
+			sa->api_calls.length, sa->api_running, g_slist_length(sa->api_conns));
+	if (!sa->api_stats)
+		return out;
+	g_string_append_printf(out, ", at most %u queued\n", sa->api_stats->max_queued);
+
+	GList *names = g_list_sort(g_hash_table_get_keys(sa->api_stats->endpoints), api_stats_cmp);
+	for (GList *l = names; l; l = l->next) {
+		const struct api_stats *s = g_hash_table_lookup(sa->api_stats->endpoints, l->data);
+		g_string_append_printf(out, "%s: %" G_GUINT64_FORMAT " calls, %" G_GUINT64_FORMAT " errors, %" G_GUINT64_FORMAT " ratelimited, %" G_GUINT64_FORMAT " cached, %" G_GUINT64_FORMAT "B out, %" G_GUINT64_FORMAT "B in;",
+				(const char *)l->data, s->calls, s->errors, s->ratelimited, s->cached, s->bytes_out, s->bytes_in);
+		api_hist_print(out, "queue", &s->wait);
+		api_hist_print(out, "first byte", &s->ttfb);
+		api_hist_print(out, "total", &s->time);
+		g_string_truncate(out, out->len-1);
+		g_string_append_c(out, '\n');
+	}
+	g_list_free(names);
+	g_string_truncate(out, out->len-1);
+	return out;
+}
+
+static void api_stats_free(SlackAccount *sa) {
+	if (!sa->api_stats)
+		return;
+	g_hash_table_destroy(sa->api_stats->endpoints);
+	g_free(sa->api_stats);
+	sa->api_stats = NULL;
+}
+
 struct _SlackAPICall {
 	SlackAccount *sa;
-	char *url;
+	char *url; /* or: */
+	SlackRequestPrefix *prefix;
 	char *request;
-	PurpleUtilFetchUrlData *fetch;
-	guint timeout;
+	char *order; /* calls with the same order key (channel) are run one at a time, in order */
+	SlackAPITier tier;
+	SlackAPIPriority priority;
+	char *array; /* property to stream to element */
+	SlackAPIElementCallback *element;
+	char *cache_key; /* to store the response under */
+	unsigned cache_ttl;
+	char *cached; /* response from the cache, instead of running */
+	SlackAPIConn *conn; /* while running */
+	struct api_stats *stats;
+	gint64 queued, sent, first_byte; /* monotonic times */
+	gsize bytes_in;
+	gboolean retried; /* already resent once after a dropped keep-alive connection */
+	gboolean once; /* must not be resent or pipelined */
 	SlackAPICallback *callback;
 	gpointer data;
 };
@@ -27,38 +364,92 @@ struct _SlackAPICall {
 static void api_free(SlackAPICall *call) {
 	g_free(call->request);
 	g_free(call->url);
+	slack_request_prefix_unref(call->prefix);
+	g_free(call->order);
+	g_free(call->array);
+	g_free(call->cache_key);
+	g_free(call->cached);
 	g_free(call);
 }
 
 static void api_error(SlackAPICall *call, const char *error) {
-	if (call->fetch)
-		purple_util_fetch_url_cancel(call->fetch);
-	if (call->timeout)
-		purple_timeout_remove(call->timeout);
 	if (call->callback)
 		call->callback(call->sa, call->data, NULL, error);
 	api_free(call);
 };
 
-static gboolean api_retry(SlackAPICall *call);
 static void api_run(SlackAccount *sa);
 
-static char *slack_api_encode_post_request_as_app(SlackAccount *sa, const char *url, va_list qargs);
-static void api_cb(PurpleUtilFetchUrlData *fetch, gpointer data, const gchar *buf, gsize len, const gchar *error) {
-	SlackAccount *sa = data;
-	SlackAPICall *call = g_queue_pop_head(&sa->api_calls);
-	g_return_if_fail(call && (call->fetch == fetch || (call->fetch == NULL && error)));
-	call->fetch = NULL;
+/* Find the value of a header in a (nul-terminated) response header block */
+static const char *api_header(const char *headers, const char *name) {
+	if (!headers)
+		return NULL;
+	size_t nlen = strlen(name);
+	const char *p = headers;
+	while ((p = strstr(p, "\r\n"))) {
+		p += 2;
+		if (!g_ascii_strncasecmp(p, name, nlen) && p[nlen] == ':') {
+			p += nlen+1;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			return p;
+		}
+	}
+	return NULL;
+}
 
-	purple_debug_misc("slack", "api response: %s\n", error ?: buf);
-	printf( "api response: %s\n", error ?: buf);
+/* The call was ratelimited: pause its whole tier, and leave it queued to be retried */
+static void api_ratelimited(SlackAPICall *call, const char *retry_after) {
+	SlackAccount *sa = call->sa;
+	int delay = retry_after ? atoi(retry_after) : 0;
+	if (delay <= 0)
+		/* #27: no (usable) Retry-After header, so we just heuristically make up a number... */
+		delay = purple_account_get_int(sa->account, "ratelimit_delay", 15);
+	purple_debug_warning("slack", "ratelimited: pausing tier %d for %ds\n", call->tier+1, delay);
+
+	struct api_bucket *b = &sa->api_limits->bucket[call->tier];
+	b->paused = g_get_monotonic_time() + (gint64)delay * G_USEC_PER_SEC;
+	b->tokens = 0;
+}
+
+/* Count a finished call in the stats */
+static void api_done_stats(SlackAPICall *call, gboolean ok) {
+	struct api_stats *stats = call->stats;
+	gint64 now = g_get_monotonic_time();
+	stats->calls++;
+	if (!ok)
+		stats->errors++;
+	if (call->cached)
+		stats->cached++;
+	else if (call->sent) {
+		api_hist_add(&stats->wait, call->sent - call->queued);
+		if (call->first_byte)
+			api_hist_add(&stats->ttfb, call->first_byte - call->sent);
+	}
+	api_hist_add(&stats->time, now - call->queued);
+}
+
+/* A call has finished (no longer running) with the given response or error */
+static void api_done(SlackAPICall *call, const char *headers, const gchar *buf, gsize len, const gchar *error) {
+	SlackAccount *sa = call->sa;
+	call->stats->bytes_in += call->bytes_in;
+	call->bytes_in = 0;
+
+	if (error)
+		slack_trace(SLACK_TRACE_API, SLACK_TRACE_INFO, "error %s", error);
+	else
+		slack_trace_payload(SLACK_TRACE_API, "response", buf, len);
 	if (error) {
+		api_done_stats(call, FALSE);
+		g_queue_remove(&sa->api_calls, call);
 		api_error(call, error);
 		api_run(sa);
 		return;
 	}
 	json_value *json = json_parse(buf, len);
 	if (!json) {
+		api_done_stats(call, FALSE);
+		g_queue_remove(&sa->api_calls, call);
 		api_error(call, "Invalid JSON response");
 		api_run(sa);
 		return;
@@ -67,19 +458,27 @@ static void api_cb(PurpleUtilFetchUrlData *fetch, gpointer data, const gchar *bu
 	if (!json_get_prop_boolean(json, "ok", FALSE)) {
 		const char *err = json_get_prop_strptr(json, "error");
 		if (!g_strcmp0(err, "ratelimited")) {
-			/* #27: correct thing to do on 429 status is parse the "Retry-After" header and wait that many seconds,
-			 * but getting access to the headers here requires more work, so we just heuristically make up a number... */
-			g_queue_push_head(&sa->api_calls, call);
-			call->timeout = purple_timeout_add_seconds(purple_account_get_int(sa->account, "ratelimit_delay", 15), (GSourceFunc)api_retry, call);
+			/* The call keeps its place in the queue (and holds back later calls with the same order) until its tier resumes. */
+			call->stats->ratelimited++;
+			call->sent = call->first_byte = 0;
+			api_ratelimited(call, api_header(headers, "Retry-After"));
 			json_value_free(json);
+			api_run(sa);
 			return;
 		}
+		api_done_stats(call, FALSE);
+		g_queue_remove(&sa->api_calls, call);
 		api_error(call, err ?: "Unknown error");
 		json_value_free(json);
 		api_run(sa);
 		return;
 	}
 
+	if (call->cache_key)
+		api_cache_store(sa, call->cache_key, call->cache_ttl, buf, len);
+	api_done_stats(call, TRUE);
+
+	g_queue_remove(&sa->api_calls, call);
 	if (call->callback)
 		if (call->callback(call->sa, call->data, json, NULL))
 			json = NULL;
@@ -89,62 +488,597 @@ static void api_cb(PurpleUtilFetchUrlData *fetch, gpointer data, const gchar *bu
 	api_run(sa);
 }
 
-static gboolean api_retry(SlackAPICall *call) {
-	g_return_val_if_fail(call == g_queue_peek_head(&call->sa->api_calls), FALSE);
-	call->timeout = 0;
-	purple_debug_misc("slack", "api call: %s\n%s\n", call->url, call->request ?: "");
-	PurpleUtilFetchUrlData *fetch =
-		purple_util_fetch_url_request_len_with_account(call->sa->account,
-			call->url, TRUE, NULL, TRUE, call->request, FALSE, 4096*1024,
-			api_cb, call->sa);
-	if (fetch)
-		call->fetch = fetch;
+/* Persistent HTTP/1.1 connections to the API host.
+ * Requests are pipelined on each connection and answered in order. */
+
+#define API_CONN_MAX		4
+#define API_MAX_RESPONSE	(4096*1024)
+
+typedef enum {
+	API_CONN_HEADERS,
+	API_CONN_BODY,
+	API_CONN_CHUNK_SIZE,
+	API_CONN_CHUNK_DATA,
+	API_CONN_CHUNK_END,
+	API_CONN_TRAILER,
+} SlackAPIConnState;
+
+struct _SlackAPIConn {
+	SlackAccount *sa;
+	char *host;
+	int port;
+	gboolean tls;
+
+	PurpleSslConnection *ssl; /* or: */
+	PurpleProxyConnectData *connecting;
+	int fd;
+	guint read_inpa;
+	gboolean connected;
+	guint inpa; /* write watcher, while output is pending */
+	gboolean reused; /* has completed a response, so a drop may just be an expired keep-alive */
+	gboolean close; /* no more requests: server is closing after the current response */
+
+	GString *output;
+	gsize output_off;
+
+	GQueue pending; /* SlackAPICall sent (or to be sent), awaiting responses in order */
+
+	/* response parsing */
+	GString *input; /* unparsed bytes */
+	guint64 consumed, response_begin; /* parsed bytes, in total and before the current response */
+	SlackAPIConnState state;
+	char *headers;
+	gsize remaining; /* of body or chunk */
+	gboolean until_close; /* body delimited by connection close */
+	GString *body;
+	SlackJSONStream *stream; /* instead of body, for calls with an element callback */
+	z_stream *inflate; /* for compressed (Content-Encoding) bodies */
+};
+
+static void api_conn_inflate_end(SlackAPIConn *conn) {
+	if (!conn->inflate)
+		return;
+	inflateEnd(conn->inflate);
+	g_free(conn->inflate);
+	conn->inflate = NULL;
+}
+
+static void api_conn_free(SlackAPIConn *conn) {
+	SlackAccount *sa = conn->sa;
+	sa->api_conns = g_slist_remove(sa->api_conns, conn);
+
+	if (conn->inpa)
+		purple_input_remove(conn->inpa);
+	if (conn->read_inpa)
+		purple_input_remove(conn->read_inpa);
+	if (conn->connecting)
+		purple_proxy_connect_cancel(conn->connecting);
+	if (conn->ssl)
+		purple_ssl_close(conn->ssl);
+	else if (conn->fd >= 0)
+		close(conn->fd);
+
+	g_string_free(conn->output, TRUE);
+	g_string_free(conn->input, TRUE);
+	if (conn->body)
+		g_string_free(conn->body, TRUE);
+	if (conn->stream)
+		g_string_free(slack_json_stream_finish(conn->stream), TRUE);
+	api_conn_inflate_end(conn);
+	g_free(conn->headers);
+	g_free(conn->host);
+	g_free(conn);
+}
+
+/* Close the connection, failing (or, if they might never have reached the server, requeuing) any outstanding calls */
+static void api_conn_close(SlackAPIConn *conn, const char *error) {
+	SlackAccount *sa = conn->sa;
+	/* has the server started answering the first call? */
+	gboolean started = conn->state != API_CONN_HEADERS || conn->input->len;
+	GQueue failed = G_QUEUE_INIT;
+	SlackAPICall *call;
+
+	if ((call = g_queue_peek_head(&conn->pending)))
+		/* whatever arrived of its response, whether it's failed or resent */
+		call->stats->bytes_in += conn->consumed - conn->response_begin + conn->input->len;
+
+	while ((call = g_queue_pop_head(&conn->pending))) {
+		call->conn = NULL;
+		sa->api_running--;
+		if (!error)
+			/* server said it was closing, so these were never processed */
+			;
+		else if (conn->reused && !started && !call->retried && !call->once)
+			/* probably just an expired keep-alive: try again on a new connection */
+			call->retried = TRUE;
+		else
+			g_queue_push_tail(&failed, call);
+		started = FALSE;
+	}
+
+	if (error)
+		purple_debug_warning("slack", "api connection to %s: %s\n", conn->host, error);
+	api_conn_free(conn);
+
+	while ((call = g_queue_pop_head(&failed))) {
+		api_done_stats(call, FALSE);
+		g_queue_remove(&sa->api_calls, call);
+		api_error(call, error);
+	}
+	api_run(sa);
+}
+
+static void api_conn_write_cb(gpointer data, G_GNUC_UNUSED gint source, G_GNUC_UNUSED PurpleInputCondition cond) {
+	SlackAPIConn *conn = data;
+
+	while (conn->output_off < conn->output->len) {
+		const char *buf = conn->output->str + conn->output_off;
+		gsize siz = conn->output->len - conn->output_off;
+		gssize len = conn->ssl ? (gssize)purple_ssl_write(conn->ssl, buf, siz) : write(conn->fd, buf, siz);
+		if (len < 0 && errno == EAGAIN)
+			return;
+		if (len <= 0) {
+			api_conn_close(conn, len < 0 ? g_strerror(errno) : "Connection closed");
+			return;
+		}
+		conn->output_off += len;
+	}
+
+	g_string_truncate(conn->output, 0);
+	conn->output_off = 0;
+	purple_input_remove(conn->inpa);
+	conn->inpa = 0;
+}
+
+/* Start writing any buffered output (from the main loop, so this never fails inline) */
+static void api_conn_flush(SlackAPIConn *conn) {
+	if (conn->connected && !conn->inpa && conn->output->len)
+		conn->inpa = purple_input_add(conn->ssl ? conn->ssl->fd : conn->fd, PURPLE_INPUT_WRITE, api_conn_write_cb, conn);
+}
+
+static void api_conn_consume(SlackAPIConn *conn, gsize len) {
+	g_string_erase(conn->input, 0, len);
+	conn->consumed += len;
+}
+
+/* Finish the response to the first pending call.
+ * Returns FALSE if the connection was closed. */
+static gboolean api_conn_complete(SlackAPIConn *conn) {
+	SlackAPICall *call = g_queue_pop_head(&conn->pending);
+	char *headers = conn->headers;
+	GString *body = conn->stream ? slack_json_stream_finish(conn->stream) : conn->body;
+	conn->headers = NULL;
+	conn->body = NULL;
+	conn->stream = NULL;
+	api_conn_inflate_end(conn);
+	conn->state = API_CONN_HEADERS;
+	conn->reused = TRUE;
+
+	call->bytes_in = conn->consumed - conn->response_begin;
+	conn->response_begin = conn->consumed;
+	SlackAPICall *next = g_queue_peek_head(&conn->pending);
+	if (next && conn->input->len)
+		/* pipelined response already started arriving */
+		next->first_byte = g_get_monotonic_time();
+
+	call->conn = NULL;
+	conn->sa->api_running--;
+
+	gboolean open = !conn->close;
+	if (!open)
+		api_conn_close(conn, NULL);
+
+	api_done(call, headers, body->str, body->len, NULL);
+	g_free(headers);
+	g_string_free(body, TRUE);
+	return open;
+}
+
+static void api_element_cb(json_value *element, gpointer data) {
+	SlackAPICall *call = data;
+	call->element(call->sa, call->data, element);
+}
+
+/* Add (decoded) data to the body of the current response.
+ * Returns FALSE if the connection was closed. */
+static gboolean api_conn_data(SlackAPIConn *conn, const char *buf, gsize len) {
+	if (conn->stream) {
+		/* elements are handed off as they arrive, so only the rest is limited */
+		if (slack_json_stream_feed(conn->stream, buf, len, API_MAX_RESPONSE))
+			return TRUE;
+	} else if (conn->body->len + len <= API_MAX_RESPONSE) {
+		g_string_append_len(conn->body, buf, len);
+		return TRUE;
+	}
+	api_conn_close(conn, "Response too large");
 	return FALSE;
 }
 
-static void api_run(SlackAccount *sa) {
-	SlackAPICall *call = g_queue_peek_head(&sa->api_calls);
-	if (!call || call->fetch || call->timeout)
-		return;
-	api_retry(call);
+/* Add the next part of the (encoded) body of the current response.
+ * Returns FALSE if the connection was closed. */
+static gboolean api_conn_body(SlackAPIConn *conn, const char *buf, gsize len) {
+	z_stream *z = conn->inflate;
+	if (!z)
+		return api_conn_data(conn, buf, len);
+
+	char out[16384];
+	z->next_in = (Bytef *)buf;
+	z->avail_in = len;
+	do {
+		z->next_out = (Bytef *)out;
+		z->avail_out = sizeof(out);
+		int r = inflate(z, Z_NO_FLUSH);
+		if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+			api_conn_close(conn, "Invalid compressed response");
+			return FALSE;
+		}
+		if (!api_conn_data(conn, out, sizeof(out) - z->avail_out))
+			return FALSE;
+		if (r != Z_OK)
+			/* end of stream (anything after is ignored), or no more progress possible */
+			break;
+	} while (z->avail_in || !z->avail_out);
+	return TRUE;
 }
 
+/* Parse as many responses out of the input as possible.
+ * Returns FALSE if the connection was closed. */
+static gboolean api_conn_parse(SlackAPIConn *conn) {
+	gsize off = 0;
 
-static char *slack_api_encode_post_request_as_app(SlackAccount *sa, const char *url, va_list qargs) {
-	GString *request;
-	gchar *host = NULL, *path = NULL;
-	purple_url_parse(url, &host, NULL, &path, NULL, NULL);
+	for (;;) {
+		const char *p = conn->input->str + off;
+		gsize avail = conn->input->len - off;
+		const char *eol;
+		gsize n;
 
-	GString *postdata;
-	const char *param;
+		switch (conn->state) {
+			case API_CONN_HEADERS:
+				eol = g_strstr_len(p, avail, "\r\n\r\n");
+				if (!eol) {
+					if (avail > 65536) {
+						api_conn_close(conn, "Response headers too long");
+						return FALSE;
+					}
+					goto more;
+				}
+				n = eol + 4 - p;
+				off += n;
+				if (strncmp(p, "HTTP/1.", 7) || n < 12) {
+					api_conn_close(conn, "Invalid HTTP response");
+					return FALSE;
+				}
+				if (p[9] == '1')
+					/* 1xx informational */
+					continue;
+				if (g_queue_is_empty(&conn->pending)) {
+					api_conn_close(conn, "Unexpected HTTP response");
+					return FALSE;
+				}
 
-printf( "app_url = %s\n", url );
+				conn->headers = g_strndup(p, n);
+				const char *te = api_header(conn->headers, "Transfer-Encoding");
+				const char *cl = api_header(conn->headers, "Content-Length");
+				const char *connection = api_header(conn->headers, "Connection");
+				if (connection)
+					conn->close |= !g_ascii_strncasecmp(connection, "close", 5);
+				else
+					conn->close |= p[7] == '0'; /* HTTP/1.0 */
+				const char *ce = api_header(conn->headers, "Content-Encoding");
+				if (ce && (!g_ascii_strncasecmp(ce, "gzip", 4) || !g_ascii_strncasecmp(ce, "x-gzip", 6) || !g_ascii_strncasecmp(ce, "deflate", 7))) {
+					conn->inflate = g_new0(z_stream, 1);
+					/* automatic gzip or zlib header detection */
+					if (inflateInit2(conn->inflate, 15+32) != Z_OK) {
+						g_free(conn->inflate);
+						conn->inflate = NULL;
+						api_conn_close(conn, "Unable to decompress response");
+						return FALSE;
+					}
+				}
+				SlackAPICall *call = g_queue_peek_head(&conn->pending);
+				if (call->element)
+					conn->stream = slack_json_stream_new(call->array, api_element_cb, call);
+				else
+					conn->body = g_string_new(NULL);
+				conn->until_close = FALSE;
+				if (te && !g_ascii_strncasecmp(te, "chunked", 7))
+					conn->state = API_CONN_CHUNK_SIZE;
+				else if (cl) {
+					conn->remaining = g_ascii_strtoull(cl, NULL, 10);
+					conn->state = API_CONN_BODY;
+				} else {
+					conn->until_close = conn->close = TRUE;
+					conn->state = API_CONN_BODY;
+				}
+				break;
 
-	// Just a long random number.
-	guint64 delim = ((guint64)g_random_int() << 32) | (guint64)g_random_int();
+			case API_CONN_BODY:
+				n = conn->until_close ? avail : MIN(avail, conn->remaining);
+				if (!api_conn_body(conn, p, n))
+					return FALSE;
+				off += n;
+				if (conn->until_close)
+					goto more;
+				if ((conn->remaining -= n))
+					goto more;
+				api_conn_consume(conn, off);
+				off = 0;
+				if (!api_conn_complete(conn))
+					return FALSE;
+				break;
 
-	postdata = g_string_new("");
-	g_string_printf(postdata, "-----------------------------%" G_GUINT64_FORMAT "\r\n", delim);
+			case API_CONN_CHUNK_SIZE:
+				eol = g_strstr_len(p, avail, "\r\n");
+				if (!eol)
+					goto more;
+				conn->remaining = g_ascii_strtoull(p, NULL, 16);
+				off += eol + 2 - p;
+				conn->state = conn->remaining ? API_CONN_CHUNK_DATA : API_CONN_TRAILER;
+				break;
 
-	request = g_string_new(NULL);
-	g_string_append_printf(request, "\
-POST /%s HTTP/1.0\r\n\
-Host: %s\r\n\\
-Content-Type: application/json\r\n\
-Authorization: Bearer %s\r\n", path, host, sa->app_token);
+			case API_CONN_CHUNK_DATA:
+				n = MIN(avail, conn->remaining);
+				if (!api_conn_body(conn, p, n))
+					return FALSE;
+				off += n;
+				if ((conn->remaining -= n))
+					goto more;
+				conn->state = API_CONN_CHUNK_END;
+				break;
 
-	g_string_append(request, "\r\n");
+			case API_CONN_CHUNK_END:
+				if (avail < 2)
+					goto more;
+				off += 2;
+				conn->state = API_CONN_CHUNK_SIZE;
+				break;
 
+			case API_CONN_TRAILER:
+				eol = g_strstr_len(p, avail, "\r\n");
+				if (!eol)
+					goto more;
+				off += eol + 2 - p;
+				if (eol == p) {
+					api_conn_consume(conn, off);
+					off = 0;
+					if (!api_conn_complete(conn))
+						return FALSE;
+				}
+				break;
+		}
+	}
+
+more:
+	api_conn_consume(conn, off);
+	return TRUE;
+}
+
+static void api_conn_read(SlackAPIConn *conn) {
+	char buf[16384];
+
+	for (;;) {
+		gssize len = conn->ssl ? (gssize)purple_ssl_read(conn->ssl, buf, sizeof(buf)) : read(conn->fd, buf, sizeof(buf));
+		if (len < 0 && errno == EAGAIN)
+			return;
+		if (len < 0) {
+			api_conn_close(conn, g_strerror(errno));
+			return;
+		}
+		if (len == 0) {
+			if (conn->state == API_CONN_BODY && conn->until_close)
+				api_conn_complete(conn);
+			else
+				api_conn_close(conn, g_queue_is_empty(&conn->pending) ? NULL : "Connection closed");
+			return;
+		}
+		SlackAPICall *head = g_queue_peek_head(&conn->pending);
+		if (head && !head->first_byte)
+			head->first_byte = g_get_monotonic_time();
+		g_string_append_len(conn->input, buf, len);
+		if (!api_conn_parse(conn))
+			return;
+	}
+}
+
+static void api_conn_input_cb(gpointer data, G_GNUC_UNUSED PurpleSslConnection *ssl, G_GNUC_UNUSED PurpleInputCondition cond) {
+	api_conn_read(data);
+}
+
+static void api_conn_read_cb(gpointer data, G_GNUC_UNUSED gint source, G_GNUC_UNUSED PurpleInputCondition cond) {
+	api_conn_read(data);
+}
+
+static void api_conn_connect_cb(gpointer data, PurpleSslConnection *ssl, G_GNUC_UNUSED PurpleInputCondition cond) {
+	SlackAPIConn *conn = data;
+	conn->connected = TRUE;
+	purple_ssl_input_add(ssl, api_conn_input_cb, conn);
+	api_conn_flush(conn);
+}
+
+/* Plain http (a test server, say) */
+static void api_conn_proxy_cb(gpointer data, gint source, const gchar *error_message) {
+	SlackAPIConn *conn = data;
+	conn->connecting = NULL;
+	if (source < 0) {
+		api_conn_close(conn, error_message ?: "Unable to connect");
+		return;
+	}
+	conn->fd = source;
+	conn->connected = TRUE;
+	conn->read_inpa = purple_input_add(source, PURPLE_INPUT_READ, api_conn_read_cb, conn);
+	api_conn_flush(conn);
+}
+
+static void api_conn_error_cb(G_GNUC_UNUSED PurpleSslConnection *ssl, PurpleSslErrorType error, gpointer data) {
+	SlackAPIConn *conn = data;
+	conn->ssl = NULL; /* closed by libpurple */
+	api_conn_close(conn, purple_ssl_strerror(error));
+}
+
+/* Find a connection to send a call to host:port on, opening one if none are idle and the pool is not full.
+ * Interactive calls may open one more rather than be pipelined behind other responses,
+ * and calls that mustn't be sent twice always go on an idle connection of their own. */
+static SlackAPIConn *api_conn_get(SlackAccount *sa, SlackAPICall *call, const char *host, int port, gboolean tls) {
+	SlackAPIConn *best = NULL;
+	unsigned count = 0;
+	for (GSList *l = sa->api_conns; l; l = l->next) {
+		SlackAPIConn *conn = l->data;
+		if (conn->close || conn->port != port || conn->tls != tls || g_ascii_strcasecmp(conn->host, host))
+			continue;
+		count++;
+		if (!best || conn->pending.length < best->pending.length)
+			best = conn;
+	}
+	if (best && (g_queue_is_empty(&best->pending) ||
+			(!call->once && count >= API_CONN_MAX + (call->priority == SLACK_API_INTERACTIVE))))
+		return best;
+
+	SlackAPIConn *conn = g_new0(SlackAPIConn, 1);
+	conn->sa = sa;
+	conn->host = g_strdup(host);
+	conn->port = port;
+	conn->tls = tls;
+	conn->fd = -1;
+	conn->output = g_string_new(NULL);
+	conn->input = g_string_new(NULL);
+	g_queue_init(&conn->pending);
+	if (tls)
+		conn->ssl = purple_ssl_connect(sa->account, host, port, api_conn_connect_cb, api_conn_error_cb, conn);
+	else
+		conn->connecting = purple_proxy_connect(NULL, sa->account, host, port, api_conn_proxy_cb, conn);
+	if (!conn->ssl && !conn->connecting) {
+		api_conn_free(conn);
+		return call->once ? NULL : best;
+	}
+	slack_trace(SLACK_TRACE_API, SLACK_TRACE_DEBUG, "connection to %s:%d", host, port);
+	sa->api_conns = g_slist_prepend(sa->api_conns, conn);
+	return conn;
+}
+
+static void api_start(SlackAPICall *call) {
+	SlackAccount *sa = call->sa;
+	if (slack_trace_enabled(SLACK_TRACE_API, SLACK_TRACE_INFO))
+		slack_trace_log(SLACK_TRACE_API, SLACK_TRACE_INFO, "call %.*s", (int)strcspn(call->request, "\r\n"), call->request);
+	slack_trace_payload(SLACK_TRACE_API, "request", call->request, -1);
+
+	char *host = NULL;
+	int port = 0;
+	SlackAPIConn *conn = NULL;
+	if (call->prefix)
+		conn = api_conn_get(sa, call, call->prefix->host, call->prefix->port, call->prefix->tls);
+	else if (purple_url_parse(call->url, &host, &port, NULL, NULL, NULL)) {
+		gboolean tls = g_ascii_strncasecmp(call->url, "http:", 5) != 0;
+		/* hack to fix default port */
+		if (port == 80 && tls)
+			port = 443;
+		conn = api_conn_get(sa, call, host, port, tls);
+	}
 	g_free(host);
-	g_free(path);
-	g_string_free(postdata, TRUE);
 
-	return g_string_free(request, FALSE);
+	if (!conn) {
+		g_queue_remove(&sa->api_calls, call);
+		api_error(call, "Unable to connect to API");
+		return;
+	}
+
+	sa->api_running++;
+	call->conn = conn;
+	call->sent = g_get_monotonic_time();
+	call->stats->bytes_out += strlen(call->request);
+	g_queue_push_tail(&conn->pending, call);
+	g_string_append(conn->output, call->request);
+	api_conn_flush(conn);
 }
 
+static gboolean api_wake_cb(gpointer data) {
+	SlackAccount *sa = data;
+	sa->api_limits->wake_timer = 0;
+	api_run(sa);
+	return FALSE;
+}
 
+static gboolean api_run_cb(gpointer data) {
+	SlackAccount *sa = data;
+	sa->api_run_timer = 0;
+
+	SlackAPILimits *limits = sa->api_limits;
+	if (limits->wake_timer) {
+		purple_timeout_remove(limits->wake_timer);
+		limits->wake_timer = 0;
+	}
+
+	int limit = purple_account_get_int(sa->account, "api_concurrency", 4);
+	if (limit < 1)
+		limit = 1;
 
-static char *slack_api_encode_post_request(SlackAccount *sa, const char *url, va_list qargs) {
+	gint64 now = g_get_monotonic_time();
+	gint64 wake = 0; /* time until the soonest token for a waiting call */
+	/* Each lane starts its calls only once every higher lane has nothing left waiting (except on a tier's budget).
+	 * The last slot is kept free for interactive calls. */
+	for (SlackAPIPriority priority = SLACK_API_INTERACTIVE; priority < SLACK_API_DEFAULT; priority++) {
+		guint lane_limit = priority == SLACK_API_INTERACTIVE || limit == 1 ? limit : limit - 1;
+		gboolean waiting = FALSE;
+		/* order keys of calls already ahead in the queue */
+		GHashTable *ordered = NULL;
+		GList *l = sa->api_calls.head;
+		while (l) {
+			SlackAPICall *call = l->data;
+			/* api_start may complete (and remove) call, but only call */
+			l = l->next;
+
+			gboolean blocked = FALSE;
+			if (call->order) {
+				if (!ordered)
+					ordered = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+				else
+					blocked = g_hash_table_lookup(ordered, call->order) != NULL;
+				if (!blocked)
+					g_hash_table_insert(ordered, g_strdup(call->order), call->sa);
+			}
+
+			if (call->cached && !blocked) {
+				/* no need to wait for anything */
+				api_done(call, NULL, call->cached, strlen(call->cached), NULL);
+				continue;
+			}
+			if (call->conn || call->cached || call->priority != priority)
+				continue;
+			if (blocked || sa->api_running >= lane_limit) {
+				waiting = TRUE;
+				continue;
+			}
+
+			gint64 wait;
+			if (!api_bucket_take(&limits->bucket[call->tier], call->tier, now, &wait)) {
+				/* only its tier is held up: lower lanes may still use others */
+				if (!wake || wait < wake)
+					wake = wait;
+				continue;
+			}
+			api_start(call);
+		}
+
+		if (ordered)
+			g_hash_table_destroy(ordered);
+		if (waiting)
+			break;
+	}
+
+	if (wake)
+		limits->wake_timer = purple_timeout_add(wake / 1000 + 1, api_wake_cb, sa);
+	return FALSE;
+}
+
+/* Schedule starting any queued calls that can run.
+ * Always deferred to the main loop so that callers (and api callbacks) are never re-entered. */
+static void api_run(SlackAccount *sa) {
+	if (!sa->api_limits)
+		sa->api_limits = g_new0(SlackAPILimits, 1);
+	if (!sa->api_run_timer)
+		sa->api_run_timer = purple_timeout_add(0, api_run_cb, sa);
+}
+
+static char *slack_api_encode_post_request_as_app(SlackAccount *sa, const char *url, va_list qargs) {
 	GString *request;
 	gchar *host = NULL, *path = NULL;
 	purple_url_parse(url, &host, NULL, &path, NULL, NULL);
@@ -152,43 +1086,24 @@ static char *slack_api_encode_post_request(SlackAccount *sa, const char *url, va
 	GString *postdata;
 	const char *param;
 
-printf( "url = %s\n", url );
+	slack_trace(SLACK_TRACE_API, SLACK_TRACE_DEBUG, "app url %s", url);
 
 	// Just a long random number.
 	guint64 delim = ((guint64)g_random_int() << 32) | (guint64)g_random_int();
 
 	postdata = g_string_new("");
 	g_string_printf(postdata, "-----------------------------%" G_GUINT64_FORMAT "\r\n", delim);
-	while ((param = va_arg(qargs, const char*))) {
-		const char *val = va_arg(qargs, const char*);
-		g_string_append_printf(postdata, "\
-Content-Disposition: form-data; name=\"%s\"\r\n\
-\r\n\
-%s\r\n\
------------------------------%" G_GUINT64_FORMAT "\r\n",
-			param, val, delim);
-	}
-
-	g_string_append_printf(postdata,
-"Content-Disposition: form-data; name=\"token\"\r\n\
-\r\n\
-%s\r\n\
------------------------------%" G_GUINT64_FORMAT "\r\n",
-		sa->token, delim);
 
 	request = g_string_new(NULL);
 	g_string_append_printf(request, "\
-POST /%s HTTP/1.0\r\n\
+POST /%s HTTP/1.1\r\n\
 Host: %s\r\n\
-Content-Type: multipart/form-data; boundary=---------------------------%" G_GUINT64_FORMAT "\r\n\
-Content-Length: %" G_GSIZE_FORMAT "\r\n",
-		path, host, delim, postdata->len);
+Content-Type: application/json\r\n\
+Content-Length: 0\r\n\
+Accept-Encoding: gzip, deflate\r\n\
+Authorization: Bearer %s\r\n", path, host, sa->app_token);
 
-	if (sa->d_cookie) {
-		g_string_append_printf(request, "Cookie: d=%s\r\n", sa->d_cookie);
-	}
 	g_string_append(request, "\r\n");
-	g_string_append(request, postdata->str);
 
 	g_free(host);
 	g_free(path);
@@ -197,18 +1112,61 @@ Content-Length: %" G_GSIZE_FORMAT "\r\n",
 	return g_string_free(request, FALSE);
 }
 
-static void slack_api_call_url(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, const char *url, const char *request) {
+
+
+/* Queue a call to url (or prefix) with the given request, which it takes ownership of */
+static SlackAPICall *slack_api_call_url(SlackAccount *sa, const char *endpoint, SlackAPICallback callback, gpointer user_data, const char *url, SlackRequestPrefix *prefix, char *request, const char *order, SlackAPITier tier, SlackAPIPriority priority) {
+	if (order)
+		/* earlier calls this one must wait for inherit its priority, so they don't hold it back */
+		for (GList *l = sa->api_calls.head; l; l = l->next) {
+			SlackAPICall *prev = l->data;
+			if (prev->priority > priority && !g_strcmp0(prev->order, order))
+				prev->priority = priority;
+		}
+
 	SlackAPICall *call = g_new0(SlackAPICall, 1);
 	call->sa = sa;
+	call->tier = tier;
+	call->priority = priority;
+	call->once = api_endpoint_once(endpoint);
+	call->stats = api_stats_get(sa, endpoint);
+	call->queued = g_get_monotonic_time();
 	call->callback = callback;
 	call->url = g_strdup(url);
-	call->request = g_strdup(request);
+	call->prefix = prefix ? slack_request_prefix_ref(prefix) : NULL;
+	call->request = request;
+	call->order = g_strdup(order);
 	call->data = user_data;
 
-	gboolean empty = g_queue_is_empty(&sa->api_calls);
 	g_queue_push_tail(&sa->api_calls, call);
-	if (empty)
-		api_retry(call);
+	if (sa->api_calls.length > sa->api_stats->max_queued)
+		sa->api_stats->max_queued = sa->api_calls.length;
+	api_run(sa);
+	return call;
+}
+
+/* The cache key for a call: endpoint?param=value&... */
+static char *api_cache_key(const char *endpoint, va_list qargs) {
+	GString *key = g_string_new(endpoint);
+	char sep = '?';
+	const char *param;
+	while ((param = va_arg(qargs, const char*))) {
+		const char *val = va_arg(qargs, const char*);
+		g_string_append_printf(key, "%c%s=%s", sep, param, val);
+		sep = '&';
+	}
+	return g_string_free(key, FALSE);
+}
+
+/* Calls on the same channel must complete in order (e.g., posts and edits), so use it as the order key */
+static const char *api_order_key(va_list qargs) {
+	const char *param;
+	while ((param = va_arg(qargs, const char*))) {
+		const char *val = va_arg(qargs, const char*);
+		if (!strcmp(param, "channel"))
+			return val;
+	}
+	return NULL;
 }
 
 
@@ -222,32 +1180,110 @@ void slack_api_post_as_app(SlackAccount *sa, SlackAPICallback callback, gpointer
 	char *request = slack_api_encode_post_request_as_app(sa, url->str, qargs);
 	va_end(qargs);
 
-	slack_api_call_url(sa, callback, user_data, url->str, request);
+	slack_api_call_url(sa, endpoint, callback, user_data, url->str, NULL, request, NULL, api_endpoint_tier(endpoint), api_endpoint_priority(sa, endpoint, SLACK_API_DEFAULT));
 
 	g_string_free(url, TRUE);
-  	g_free(request);
 }
 
 
 
-void slack_api_post(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, const gchar *endpoint, ...)
+static SlackAPICall *api_post(SlackAccount *sa, SlackAPIPriority priority, SlackAPICallback callback, gpointer user_data, const gchar *endpoint, va_list args)
 {
-	GString *url = g_string_new(NULL);
-	g_string_printf(url, "%s/%s", sa->api_url, endpoint);
+	/* The prefix is built once, and only again if login changes the url or credentials */
+	if (!sa->api_prefix || !slack_request_prefix_matches(sa->api_prefix, sa->api_url, sa->token, sa->d_cookie)) {
+		slack_request_prefix_unref(sa->api_prefix);
+		sa->api_prefix = slack_request_prefix_new(sa->api_url, sa->token, sa->d_cookie);
+	}
+	if (!sa->api_body)
+		sa->api_body = g_string_sized_new(1024);
+
+	va_list qargs;
+	va_copy(qargs, args);
+	const char *order = api_order_key(qargs);
+	va_end(qargs);
+
+	va_copy(qargs, args);
+	char *request = slack_request_encode(sa->api_prefix, sa->api_body, endpoint, qargs);
+	va_end(qargs);
 
+	SlackAPICall *call = slack_api_call_url(sa, endpoint, callback, user_data, NULL, sa->api_prefix, request, order, api_endpoint_tier(endpoint), api_endpoint_priority(sa, endpoint, priority));
+
+	const struct api_endpoint *e = api_endpoint(endpoint);
+	if (e && e->ttl) {
+		va_copy(qargs, args);
+		char *key = api_cache_key(endpoint, qargs);
+		va_end(qargs);
+		struct api_cache_entry *entry = api_cache_lookup(sa, key);
+		if (entry) {
+			call->cached = g_strndup(entry->body, entry->len);
+			g_free(key);
+		} else {
+			call->cache_key = key;
+			call->cache_ttl = e->ttl;
+		}
+	}
+	else if (e && e->changes)
+		slack_api_cache_invalidate(sa, order);
+
+	return call;
+}
+
+void slack_api_post(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, const gchar *endpoint, ...)
+{
 	va_list qargs;
 	va_start(qargs, endpoint);
-	char *request = slack_api_encode_post_request(sa, url->str, qargs);
+	api_post(sa, SLACK_API_DEFAULT, callback, user_data, endpoint, qargs);
 	va_end(qargs);
+}
 
-	slack_api_call_url(sa, callback, user_data, url->str, request);
+void slack_api_post_priority(SlackAccount *sa, SlackAPIPriority priority, SlackAPICallback callback, gpointer user_data, const gchar *endpoint, ...)
+{
+	va_list qargs;
+	va_start(qargs, endpoint);
+	api_post(sa, priority, callback, user_data, endpoint, qargs);
+	va_end(qargs);
+}
 
-	g_string_free(url, TRUE);
-  	g_free(request);
+void slack_api_post_stream(SlackAccount *sa, const char *array, SlackAPIElementCallback *element, SlackAPICallback callback, gpointer user_data, const gchar *endpoint, ...)
+{
+	va_list qargs;
+	va_start(qargs, endpoint);
+	SlackAPICall *call = api_post(sa, SLACK_API_DEFAULT, callback, user_data, endpoint, qargs);
+	va_end(qargs);
+	call->array = g_strdup(array);
+	call->element = element;
 }
 
 void slack_api_disconnect(SlackAccount *sa) {
+	if (sa->api_run_timer) {
+		purple_timeout_remove(sa->api_run_timer);
+		sa->api_run_timer = 0;
+	}
+	while (sa->api_conns) {
+		SlackAPIConn *conn = sa->api_conns->data;
+		SlackAPICall *call;
+		while ((call = g_queue_pop_head(&conn->pending)))
+			call->conn = NULL;
+		api_conn_free(conn);
+	}
+
 	SlackAPICall *call;
 	while ((call = g_queue_pop_head(&sa->api_calls)))
 		api_error(call, "disconnected");
+	api_cache_clear(sa);
+	api_stats_free(sa);
+
+	slack_request_prefix_unref(sa->api_prefix);
+	sa->api_prefix = NULL;
+	if (sa->api_body)
+		g_string_free(sa->api_body, TRUE);
+	sa->api_body = NULL;
+	sa->api_running = 0;
+
+	if (sa->api_limits) {
+		if (sa->api_limits->wake_timer)
+			purple_timeout_remove(sa->api_limits->wake_timer);
+		g_free(sa->api_limits);
+		sa->api_limits = NULL;
+	}
 }
@@ -9,11 +9,30 @@ PurpleConnectionError slack_api_connection_error(const gchar *error);
 
 typedef struct _SlackAPICall SlackAPICall;
 typedef gboolean SlackAPICallback(SlackAccount *sa, gpointer user_data, json_value *json, const char *error);
+typedef void SlackAPIElementCallback(SlackAccount *sa, gpointer user_data, json_value *element);
+
+/* Order in which queued calls are started */
+typedef enum {
+	SLACK_API_INTERACTIVE, /* sends and other user actions */
+	SLACK_API_LOGIN, /* loading state while connecting */
+	SLACK_API_BACKGROUND, /* refreshes, history, paging */
+	SLACK_API_DEFAULT /* pick based on endpoint and connection state */
+} SlackAPIPriority;
 
 void slack_api_post(SlackAccount *sa, SlackAPICallback *callback, gpointer user_data, const char *endpoint, /* const char *query_param1, const char *query_value1, */ ...) G_GNUC_NULL_TERMINATED;
+void slack_api_post_priority(SlackAccount *sa, SlackAPIPriority priority, SlackAPICallback *callback, gpointer user_data, const char *endpoint, ...) G_GNUC_NULL_TERMINATED;
+/* Like slack_api_post, but each element of the response's array property is passed to element as it arrives (and is then freed).
+ * The callback gets the rest of the response, with the array left empty. */
+void slack_api_post_stream(SlackAccount *sa, const char *array, SlackAPIElementCallback *element, SlackAPICallback *callback, gpointer user_data, const char *endpoint, ...) G_GNUC_NULL_TERMINATED;
 void slack_api_post_as_app(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, const gchar *endpoint, ...);
 void slack_api_disconnect(SlackAccount *sa);
 
+/* Describe the API queue and per-endpoint counters and latencies */
+GString *slack_api_stats(SlackAccount *sa);
+
+/* Drop any cached responses for calls with a parameter (user or channel, etc.) of id */
+void slack_api_cache_invalidate(SlackAccount *sa, const char *id);
+
 #define SLACK_LIMIT_ARG(COUNT)		"limit", G_STRINGIFY(COUNT)
 
 #define SLACK_PAGINATE_LIMIT_COUNT	500
@@ -10,6 +10,7 @@
 #include "slack-user.h"
 #include "slack-conversation.h"
 #include "slack-channel.h"
+#include "slack-trace.h"
 
 G_DEFINE_TYPE(SlackChannel, slack_channel, SLACK_TYPE_OBJECT);
 
@@ -95,7 +96,7 @@ SlackChannel *slack_channel_set(SlackAccount *sa, json_value *json, SlackChannel
 	const char *name = json_get_prop_strptr(json, "name");
 
 	if (name && g_strcmp0(chan->object.name, name)) {
-		purple_debug_misc("slack", "channel %s: %s %d\n", sid, name, type);
+		slack_trace(SLACK_TRACE_OBJECT, SLACK_TRACE_DEBUG, "channel %s: %s %d", sid, name, type);
 		
 		if (chan->object.name)
 			g_hash_table_remove(sa->channel_names, chan->object.name);
@@ -394,7 +395,7 @@ void slack_chat_invite(PurpleConnection *gc, int cid, const char *message, const
 	if (!user)
 		return;
 
-	slack_api_post(sa, NULL, NULL, "conversations.invite", "channel", chan->object.id, "user", user->object.id, NULL);
+	slack_api_post_priority(sa, SLACK_API_INTERACTIVE, NULL, NULL, "conversations.invite", "channel", chan->object.id, "user", user->object.id, NULL);
 }
 
 void slack_set_chat_topic(PurpleConnection *gc, int cid, const char *topic) {
@@ -404,5 +405,5 @@ void slack_set_chat_topic(PurpleConnection *gc, int cid, const char *topic) {
 	if (!chan)
 		return;
 
-	slack_api_post(sa, NULL, NULL, "conversations.setTopic", "channel", chan->object.id, "topic", topic, NULL);
+	slack_api_post_priority(sa, SLACK_API_INTERACTIVE, NULL, NULL, "conversations.setTopic", "channel", chan->object.id, "topic", topic, NULL);
 }
@@ -16,19 +16,20 @@ static SlackObject *conversation_update(SlackAccount *sa, json_value *json) {
 }
 
 #define CONVERSATIONS_LIST_CALL(sa, ARGS...) \
-	slack_api_post(sa, conversations_list_cb, NULL, "conversations.list", "types", "public_channel,private_channel,mpim,im", "exclude_archived", "true", SLACK_PAGINATE_LIMIT_ARG, ##ARGS, NULL)
+	slack_api_post_stream(sa, "channels", conversations_list_channel_cb, conversations_list_cb, NULL, "conversations.list", "types", "public_channel,private_channel,mpim,im", "exclude_archived", "true", SLACK_PAGINATE_LIMIT_ARG, ##ARGS, NULL)
+
+static void conversations_list_channel_cb(SlackAccount *sa, gpointer data, json_value *chan) {
+	conversation_update(sa, chan);
+}
 
 static gboolean conversations_list_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
-	json_value *chans = json_get_prop_type(json, "channels", array);
-	if (!chans) {
+	/* channels were already streamed to conversations_list_channel_cb */
+	if (!json_get_prop_type(json, "channels", array)) {
 		purple_connection_error_reason(sa->gc,
 				PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing conversation list");
 		return FALSE;
 	}
 
-	for (unsigned i = 0; i < chans->u.array.length; i++)
-		conversation_update(sa, chans->u.array.values[i]);
-
 	char *cursor = json_get_prop_strptr(json_get_prop(json, "response_metadata"), "next_cursor");
 	if (cursor && *cursor)
 		CONVERSATIONS_LIST_CALL(sa, "cursor", cursor);
@@ -115,18 +116,37 @@ SlackObject *slack_conversation_get_conversation(SlackAccount *sa, PurpleConvers
 	}
 }
 
-struct conversation_retrieve {
+struct conversation_retrieve_waiter {
 	SlackConversationCallback *cb;
 	gpointer data;
+};
+
+/* A single conversations.info call shared by everyone waiting on the same conversation */
+struct conversation_retrieve {
+	char *sid;
+	GSList *waiters; /* struct conversation_retrieve_waiter, most recent first */
 	json_value *json;
 };
 
+static void conversation_retrieve_done(SlackAccount *sa, struct conversation_retrieve *lookup, SlackObject *obj) {
+	g_hash_table_remove(sa->conversation_lookups, lookup->sid);
+	lookup->waiters = g_slist_reverse(lookup->waiters);
+	for (GSList *l = lookup->waiters; l; l = l->next) {
+		struct conversation_retrieve_waiter *w = l->data;
+		w->cb(sa, w->data, obj);
+		g_free(w);
+	}
+	g_slist_free(lookup->waiters);
+	if (lookup->json)
+		json_value_free(lookup->json);
+	g_free(lookup->sid);
+	g_free(lookup);
+}
+
 static void conversation_retrieve_user_cb(SlackAccount *sa, gpointer data, SlackUser *user) {
 	struct conversation_retrieve *lookup = data;
 	json_value *chan = json_get_prop_type(lookup->json, "channel", object);
-	lookup->cb(sa, lookup->data, conversation_update(sa, chan));
-	json_value_free(lookup->json);
-	g_free(lookup);
+	conversation_retrieve_done(sa, lookup, conversation_update(sa, chan));
 }
 
 static gboolean conversation_retrieve_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
@@ -134,8 +154,7 @@ static gboolean conversation_retrieve_cb(SlackAccount *sa, gpointer data, json_v
 	json_value *chan = json_get_prop_type(json, "channel", object);
 	if (!chan || error) {
 		purple_debug_error("slack", "Error retrieving conversation: %s\n", error ?: "missing");
-		lookup->cb(sa, lookup->data, NULL);
-		g_free(lookup);
+		conversation_retrieve_done(sa, lookup, NULL);
 		return FALSE;
 	}
 	lookup->json = json;
@@ -153,11 +172,22 @@ static gboolean conversation_retrieve_cb(SlackAccount *sa, gpointer data, json_v
 
 void slack_conversation_retrieve(SlackAccount *sa, const char *sid, SlackConversationCallback *cb, gpointer data) {
 	SlackObject *obj = slack_conversation_lookup_sid(sa, sid);
-	if (obj)
+	if (obj || !sid)
 		return cb(sa, data, obj);
-	struct conversation_retrieve *lookup = g_new(struct conversation_retrieve, 1);
-	lookup->cb = cb;
-	lookup->data = data;
+
+	struct conversation_retrieve_waiter *w = g_new(struct conversation_retrieve_waiter, 1);
+	w->cb = cb;
+	w->data = data;
+
+	struct conversation_retrieve *lookup = g_hash_table_lookup(sa->conversation_lookups, sid);
+	if (lookup) {
+		lookup->waiters = g_slist_prepend(lookup->waiters, w);
+		return;
+	}
+	lookup = g_new0(struct conversation_retrieve, 1);
+	lookup->sid = g_strdup(sid);
+	lookup->waiters = g_slist_prepend(NULL, w);
+	g_hash_table_insert(sa->conversation_lookups, lookup->sid, lookup);
 	slack_api_post(sa, conversation_retrieve_cb, lookup, "conversations.info", "channel", sid, NULL);
 }
 
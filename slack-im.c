@@ -10,6 +10,7 @@
 #include "slack-user.h"
 #include "slack-channel.h"
 #include "slack-im.h"
+#include "slack-trace.h"
 
 void slack_presence_sub(SlackAccount *sa) {
 	GString *ids = g_string_new("[");
@@ -58,7 +59,6 @@ SlackUser *slack_im_set(SlackAccount *sa, json_value *json, SlackUser *user, gbo
 		user = (SlackUser *)slack_object_hash_table_lookup(sa->users, user_id);
 		if (!user) {
 			purple_debug_warning("slack", "IM %s for unknown user: %s\n", sid, user_id);
-			printf("IM %s for unknown user: %s\n", sid, user_id);
 			return user;
 		}
 	} else
@@ -94,8 +94,7 @@ SlackUser *slack_im_set(SlackAccount *sa, json_value *json, SlackUser *user, gbo
 		user->object.buddy = NULL;
 	}
 
-	purple_debug_misc("slack", "im %s: %s\n", user->im, user->object.id);
-	printf("im %s: %s\n", user->im, user->object.id);
+	slack_trace(SLACK_TRACE_OBJECT, SLACK_TRACE_DEBUG, "im %s: %s", user->im, user->object.id);
 
 	if (changed && update_sub)
 		slack_presence_sub(sa);
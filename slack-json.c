@@ -1,6 +1,9 @@
 #include <string.h>
 
+#include <debug.h>
+
 #include "slack-json.h"
+#include "slack-trace.h"
 
 json_value *json_get_prop(json_value *val, const char *index) {
 	if (!val || val->type != json_object) {
@@ -62,3 +65,141 @@ time_t slack_parse_time(json_value *val) {
 		return slack_parse_time_str(val->u.string.ptr);
 	return 0;
 }
+
+struct _SlackJSONStream {
+	GString *array; /* "quoted" property name of the array to stream */
+	SlackJSONElementCallback *cb;
+	gpointer data;
+
+	GString *rest; /* everything else */
+	GString *element; /* current array element */
+	unsigned depth;
+	gboolean string, escape;
+	gsize key; /* offset in rest of the last string at depth 1 */
+	enum {
+		STREAM_OUTSIDE,
+		STREAM_VALUE, /* after the array property name and colon */
+		STREAM_ARRAY, /* inside the array */
+	} state;
+};
+
+SlackJSONStream *slack_json_stream_new(const char *array, SlackJSONElementCallback *cb, gpointer data) {
+	SlackJSONStream *stream = g_new0(SlackJSONStream, 1);
+	stream->array = append_json_string(g_string_new(NULL), array);
+	stream->cb = cb;
+	stream->data = data;
+	stream->rest = g_string_new(NULL);
+	stream->element = g_string_new(NULL);
+	return stream;
+}
+
+static void stream_element(SlackJSONStream *stream) {
+	if (strspn(stream->element->str, " \t\r\n") == stream->element->len) {
+		g_string_truncate(stream->element, 0);
+		return;
+	}
+	json_value *json = json_parse(stream->element->str, stream->element->len);
+	if (json) {
+		stream->cb(json, stream->data);
+		json_value_free(json);
+	} else {
+		GString *shown = slack_trace_redact(stream->element->str, stream->element->len, 64);
+		purple_debug_warning("slack", "invalid json array element (%" G_GSIZE_FORMAT " bytes): %s\n", stream->element->len, shown->str);
+		g_string_free(shown, TRUE);
+	}
+	g_string_truncate(stream->element, 0);
+}
+
+gboolean slack_json_stream_feed(SlackJSONStream *stream, const char *buf, size_t len, size_t max) {
+	const char *end = buf + len;
+	const char *span = buf; /* start of unsaved input */
+	GString *out = stream->state == STREAM_ARRAY && stream->depth > 1 ? stream->element : stream->rest;
+
+#define STREAM_SAVE(P) do { \
+		g_string_append_len(out, span, (P) - span); \
+		span = (P); \
+	} while (0)
+
+	for (const char *p = buf; p < end; p++) {
+		char c = *p;
+		if (stream->string) {
+			if (stream->escape)
+				stream->escape = FALSE;
+			else if (c == '\\')
+				stream->escape = TRUE;
+			else if (c == '"')
+				stream->string = FALSE;
+			continue;
+		}
+		switch (c) {
+			case ' ': case '\t': case '\r': case '\n':
+				break;
+			case '"':
+				stream->string = TRUE;
+				if (stream->depth == 1 && out == stream->rest) {
+					STREAM_SAVE(p);
+					stream->key = stream->rest->len;
+				}
+				break;
+			case ':':
+				if (stream->depth == 1 && stream->state == STREAM_OUTSIDE) {
+					STREAM_SAVE(p);
+					const char *key = stream->rest->str + stream->key;
+					gsize len = stream->array->len;
+					if (!strncmp(key, stream->array->str, len) && !key[len + strspn(key + len, " \t\r\n")])
+						stream->state = STREAM_VALUE;
+				}
+				break;
+			case '[':
+			case '{':
+				if (stream->state == STREAM_VALUE) {
+					stream->state = c == '[' ? STREAM_ARRAY : STREAM_OUTSIDE;
+					stream->depth++;
+					if (stream->state == STREAM_ARRAY) {
+						/* keep the opening bracket, then switch to collecting elements */
+						STREAM_SAVE(p+1);
+						out = stream->element;
+					}
+					break;
+				}
+				stream->depth++;
+				break;
+			case ']':
+			case '}':
+				stream->depth--;
+				if (stream->state == STREAM_ARRAY && stream->depth == 1) {
+					/* end of the array */
+					STREAM_SAVE(p);
+					stream_element(stream);
+					stream->state = STREAM_OUTSIDE;
+					out = stream->rest;
+				}
+				break;
+			case ',':
+				if (stream->state == STREAM_ARRAY && stream->depth == 2) {
+					STREAM_SAVE(p);
+					stream_element(stream);
+					span = p+1;
+				}
+				else if (stream->state == STREAM_VALUE)
+					stream->state = STREAM_OUTSIDE;
+				break;
+			default:
+				if (stream->state == STREAM_VALUE)
+					/* some scalar */
+					stream->state = STREAM_OUTSIDE;
+		}
+	}
+	STREAM_SAVE(end);
+#undef STREAM_SAVE
+
+	return stream->rest->len <= max && stream->element->len <= max;
+}
+
+GString *slack_json_stream_finish(SlackJSONStream *stream) {
+	GString *rest = stream->rest;
+	g_string_free(stream->element, TRUE);
+	g_string_free(stream->array, TRUE);
+	g_free(stream);
+	return rest;
+}
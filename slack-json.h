@@ -37,6 +37,17 @@ json_value *json_get_prop(json_value *val, const char *prop) __attribute__((pure
 /* Add an escaped, quoted json string to a GString */
 GString *append_json_string(GString *str, const char *s);
 
+/* Incremental parsing of a json object with one (large) array property:
+ * each element of the array is parsed and passed to the callback as it arrives, and everything else is kept. */
+typedef struct _SlackJSONStream SlackJSONStream;
+typedef void SlackJSONElementCallback(json_value *element, gpointer data);
+
+SlackJSONStream *slack_json_stream_new(const char *array, SlackJSONElementCallback *cb, gpointer data);
+/* Returns FALSE if the kept data or a single element exceeds max */
+gboolean slack_json_stream_feed(SlackJSONStream *stream, const char *buf, size_t len, size_t max);
+/* Free the stream, returning the rest of the object (with the array left empty) */
+GString *slack_json_stream_finish(SlackJSONStream *stream);
+
 time_t slack_parse_time_str(const char *str);
 time_t slack_parse_time(json_value *val);
 
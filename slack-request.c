@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slack-request.h"
+
+SlackRequestPrefix *slack_request_prefix_new(const char *api_url, const char *token, const char *cookie) {
+	SlackRequestPrefix *prefix = g_new0(SlackRequestPrefix, 1);
+	prefix->ref = 1;
+	prefix->api_url = g_strdup(api_url);
+	prefix->token = g_strdup(token);
+	prefix->cookie = g_strdup(cookie);
+
+	/* scheme://host[:port][/path] */
+	const char *host = strstr(api_url, "://");
+	prefix->port = 443;
+	prefix->tls = TRUE;
+	if (host) {
+		if (!g_ascii_strncasecmp(api_url, "http:", 5)) {
+			prefix->port = 80;
+			prefix->tls = FALSE;
+		}
+		host += 3;
+	} else
+		host = api_url;
+	const char *path = strchr(host, '/') ?: host + strlen(host);
+	const char *port = memchr(host, ':', path - host);
+	if (port) {
+		prefix->host = g_strndup(host, port - host);
+		prefix->port = atoi(port+1);
+	} else
+		prefix->host = g_strndup(host, path - host);
+
+	prefix->line = g_string_new("POST ");
+	g_string_append(prefix->line, *path ? path : "/");
+	if (prefix->line->str[prefix->line->len-1] != '/')
+		g_string_append_c(prefix->line, '/');
+
+	prefix->headers = g_string_new(NULL);
+	g_string_printf(prefix->headers, " HTTP/1.1\r\n\
+Host: %s\r\n\
+Content-Type: application/x-www-form-urlencoded\r\n\
+Accept-Encoding: gzip, deflate\r\n",
+		prefix->host);
+	if (cookie)
+		g_string_append_printf(prefix->headers, "Cookie: d=%s\r\n", cookie);
+	g_string_append(prefix->headers, "Content-Length: ");
+
+	prefix->token_param = slack_request_append_urlencoded(g_string_new("token="), token ?: "");
+	return prefix;
+}
+
+SlackRequestPrefix *slack_request_prefix_ref(SlackRequestPrefix *prefix) {
+	prefix->ref++;
+	return prefix;
+}
+
+void slack_request_prefix_unref(SlackRequestPrefix *prefix) {
+	if (!prefix || --prefix->ref)
+		return;
+	g_string_free(prefix->token_param, TRUE);
+	g_string_free(prefix->headers, TRUE);
+	g_string_free(prefix->line, TRUE);
+	g_free(prefix->host);
+	g_free(prefix->cookie);
+	g_free(prefix->token);
+	g_free(prefix->api_url);
+	g_free(prefix);
+}
+
+gboolean slack_request_prefix_matches(const SlackRequestPrefix *prefix, const char *api_url, const char *token, const char *cookie) {
+	return !g_strcmp0(prefix->api_url, api_url) &&
+		!g_strcmp0(prefix->token, token) &&
+		!g_strcmp0(prefix->cookie, cookie);
+}
+
+/* characters that don't need escaping: ALPHA / DIGIT / "-" / "." / "_" / "~" */
+static const guint8 urlencode_safe[256] = {
+	['-'] = 1, ['.'] = 1, ['_'] = 1, ['~'] = 1,
+	['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+	['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1,
+	['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+	['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1,
+	['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+GString *slack_request_append_urlencoded(GString *str, const char *s) {
+	static const char hex[] = "0123456789ABCDEF";
+	const char *run = s; /* start of unescaped characters */
+	for (; *s; s++) {
+		guint8 c = *s;
+		if (urlencode_safe[c])
+			continue;
+		g_string_append_len(str, run, s - run);
+		if (c == ' ')
+			g_string_append_c(str, '+');
+		else {
+			char esc[3] = { '%', hex[c >> 4], hex[c & 0xf] };
+			g_string_append_len(str, esc, 3);
+		}
+		run = s+1;
+	}
+	return g_string_append_len(str, run, s - run);
+}
+
+char *slack_request_encode(const SlackRequestPrefix *prefix, GString *body, const char *endpoint, va_list qargs) {
+	g_string_truncate(body, 0);
+	g_string_append_len(body, prefix->token_param->str, prefix->token_param->len);
+
+	const char *param;
+	while ((param = va_arg(qargs, const char*))) {
+		const char *val = va_arg(qargs, const char*);
+		g_string_append_c(body, '&');
+		slack_request_append_urlencoded(body, param);
+		g_string_append_c(body, '=');
+		if (val)
+			slack_request_append_urlencoded(body, val);
+	}
+
+	char length[32];
+	size_t length_len = snprintf(length, sizeof(length), "%" G_GSIZE_FORMAT "\r\n\r\n", body->len);
+	size_t endpoint_len = strlen(endpoint);
+
+	char *request = g_malloc(prefix->line->len + endpoint_len + prefix->headers->len + length_len + body->len + 1);
+	char *p = request;
+#define APPEND(S, L) do { \
+		memcpy(p, S, L); \
+		p += L; \
+	} while (0)
+	APPEND(prefix->line->str, prefix->line->len);
+	APPEND(endpoint, endpoint_len);
+	APPEND(prefix->headers->str, prefix->headers->len);
+	APPEND(length, length_len);
+	APPEND(body->str, body->len);
+#undef APPEND
+	*p = '\0';
+	return request;
+}
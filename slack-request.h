@@ -0,0 +1,36 @@
+#ifndef _PURPLE_SLACK_REQUEST_H
+#define _PURPLE_SLACK_REQUEST_H
+
+#include <stdarg.h>
+#include <glib.h>
+
+/* The parts of a Web API POST request that are the same for every call on an account.
+ * (This only depends on glib, so it can be built and benchmarked on its own.) */
+typedef struct _SlackRequestPrefix {
+	int ref;
+	/* what this was built from */
+	char *api_url, *token, *cookie;
+
+	char *host;
+	int port;
+	gboolean tls; /* https (the default), rather than http */
+
+	GString *line; /* "POST /path/" (endpoint follows) */
+	GString *headers; /* " HTTP/1.1\r\n...Content-Length: " */
+	GString *token_param; /* "token=..." */
+} SlackRequestPrefix;
+
+SlackRequestPrefix *slack_request_prefix_new(const char *api_url, const char *token, const char *cookie);
+SlackRequestPrefix *slack_request_prefix_ref(SlackRequestPrefix *prefix);
+void slack_request_prefix_unref(SlackRequestPrefix *prefix);
+gboolean slack_request_prefix_matches(const SlackRequestPrefix *prefix, const char *api_url, const char *token, const char *cookie);
+
+/* Append s as application/x-www-form-urlencoded */
+GString *slack_request_append_urlencoded(GString *str, const char *s);
+
+/* Build a request for endpoint with the NULL-terminated param, value, ... list.
+ * body is scratch space that may be reused between calls.
+ * Returns the request, which is the only allocation when body is already large enough. */
+char *slack_request_encode(const SlackRequestPrefix *prefix, GString *body, const char *endpoint, va_list qargs);
+
+#endif
@@ -0,0 +1,73 @@
+#include <string.h>
+
+#include "slack-rtm-event.h"
+
+static const SlackRTMEvent rtm_events[] = {
+	{ "message",			SLACK_RTM_MESSAGE,		SLACK_RTM_INVALIDATE }, /* decides whether it keeps the event */
+	{ "user_typing",		SLACK_RTM_USER_TYPING,		SLACK_RTM_COALESCE },
+	{ "presence_change",		SLACK_RTM_PRESENCE_CHANGE,	SLACK_RTM_INVALIDATE | SLACK_RTM_COALESCE },
+	{ "presence_change_batch",	SLACK_RTM_PRESENCE_CHANGE,	SLACK_RTM_INVALIDATE | SLACK_RTM_COALESCE },
+	{ "im_close",			SLACK_RTM_IM_CLOSE,		SLACK_RTM_INVALIDATE },
+	{ "im_open",			SLACK_RTM_IM_OPEN,		SLACK_RTM_INVALIDATE | SLACK_RTM_KEEPS_JSON },
+	/* not necessarily (and probably in reality never) open, but works as no-op in that case */
+	{ "im_created",			SLACK_RTM_IM_OPEN,		SLACK_RTM_INVALIDATE | SLACK_RTM_KEEPS_JSON },
+	{ "member_joined_channel",	SLACK_RTM_MEMBER_JOINED,	SLACK_RTM_INVALIDATE },
+	{ "member_left_channel",	SLACK_RTM_MEMBER_LEFT,		SLACK_RTM_INVALIDATE },
+	{ "user_change",		SLACK_RTM_USER_CHANGE,		SLACK_RTM_INVALIDATE | SLACK_RTM_COALESCE },
+	{ "team_join",			SLACK_RTM_USER_CHANGE,		SLACK_RTM_INVALIDATE | SLACK_RTM_COALESCE },
+	{ "channel_joined",		SLACK_RTM_CHANNEL_MEMBER,	SLACK_RTM_INVALIDATE },
+	{ "group_joined",		SLACK_RTM_CHANNEL_GROUP,	SLACK_RTM_INVALIDATE },
+	{ "group_unarchive",		SLACK_RTM_CHANNEL_GROUP,	SLACK_RTM_INVALIDATE },
+	{ "channel_left",		SLACK_RTM_CHANNEL_PUBLIC,	SLACK_RTM_INVALIDATE },
+	{ "channel_created",		SLACK_RTM_CHANNEL_PUBLIC,	SLACK_RTM_INVALIDATE },
+	{ "channel_unarchive",		SLACK_RTM_CHANNEL_PUBLIC,	SLACK_RTM_INVALIDATE },
+	{ "channel_rename",		SLACK_RTM_CHANNEL_UNKNOWN,	SLACK_RTM_INVALIDATE },
+	{ "group_rename",		SLACK_RTM_CHANNEL_UNKNOWN,	SLACK_RTM_INVALIDATE },
+	{ "channel_archive",		SLACK_RTM_CHANNEL_DELETED,	SLACK_RTM_INVALIDATE },
+	{ "channel_deleted",		SLACK_RTM_CHANNEL_DELETED,	SLACK_RTM_INVALIDATE },
+	{ "group_archive",		SLACK_RTM_CHANNEL_DELETED,	SLACK_RTM_INVALIDATE },
+	{ "group_left",			SLACK_RTM_CHANNEL_DELETED,	SLACK_RTM_INVALIDATE },
+};
+
+/* anything else may still refer to a channel we have cached */
+static const SlackRTMEvent rtm_event_unhandled = { NULL, SLACK_RTM_UNHANDLED, SLACK_RTM_INVALIDATE };
+
+/* Open-addressed index into rtm_events, built on first use; at most half full, so probes are short */
+#define RTM_EVENT_SLOTS 64
+static const SlackRTMEvent *rtm_event_index[RTM_EVENT_SLOTS];
+
+/* Cheap, and enough to tell our types apart */
+static guint rtm_event_hash(const char *s, size_t len) {
+	return len * 31 + (guchar)s[0] * 7 + (guchar)s[len/2] * 3 + (guchar)s[len-1];
+}
+
+static inline void rtm_event_index_init(void) {
+	static gboolean done;
+	guint i;
+	if (done)
+		return;
+	done = TRUE;
+	G_STATIC_ASSERT(2*G_N_ELEMENTS(rtm_events) <= RTM_EVENT_SLOTS);
+	for (i = 0; i < G_N_ELEMENTS(rtm_events); i++) {
+		guint h = rtm_event_hash(rtm_events[i].type, strlen(rtm_events[i].type));
+		while (rtm_event_index[h % RTM_EVENT_SLOTS])
+			h++;
+		rtm_event_index[h % RTM_EVENT_SLOTS] = &rtm_events[i];
+	}
+}
+
+const SlackRTMEvent *slack_rtm_event_lookup(const char *type) {
+	const SlackRTMEvent *e;
+	rtm_event_index_init();
+
+	size_t len = strlen(type);
+	if (!len)
+		return &rtm_event_unhandled;
+	guint h = rtm_event_hash(type, len);
+	while ((e = rtm_event_index[h % RTM_EVENT_SLOTS])) {
+		if (!strcmp(e->type, type))
+			return e;
+		h++;
+	}
+	return &rtm_event_unhandled;
+}
@@ -0,0 +1,38 @@
+#ifndef _PURPLE_SLACK_RTM_EVENT_H
+#define _PURPLE_SLACK_RTM_EVENT_H
+
+#include <glib.h>
+
+/* What to do with each type of RTM event.
+ * (This only depends on glib, so it can be built and benchmarked on its own.) */
+typedef enum _SlackRTMHandler {
+	SLACK_RTM_UNHANDLED = 0,
+	SLACK_RTM_MESSAGE,
+	SLACK_RTM_USER_TYPING,
+	SLACK_RTM_PRESENCE_CHANGE,
+	SLACK_RTM_IM_CLOSE,
+	SLACK_RTM_IM_OPEN,
+	SLACK_RTM_MEMBER_JOINED,
+	SLACK_RTM_MEMBER_LEFT,
+	SLACK_RTM_USER_CHANGE,
+	SLACK_RTM_CHANNEL_MEMBER,
+	SLACK_RTM_CHANNEL_GROUP,
+	SLACK_RTM_CHANNEL_PUBLIC,
+	SLACK_RTM_CHANNEL_UNKNOWN,
+	SLACK_RTM_CHANNEL_DELETED,
+} SlackRTMHandler;
+
+#define SLACK_RTM_INVALIDATE	0x1 /* may change cached API responses */
+#define SLACK_RTM_KEEPS_JSON	0x2 /* the handler takes ownership of the event */
+#define SLACK_RTM_COALESCE	0x4 /* only the latest per user matters: applied in batches */
+
+typedef struct _SlackRTMEvent {
+	const char *type;
+	SlackRTMHandler handler;
+	guint flags;
+} SlackRTMEvent;
+
+/* Look up an event type: never NULL (unknown types are SLACK_RTM_UNHANDLED) */
+const SlackRTMEvent *slack_rtm_event_lookup(const char *type);
+
+#endif
@@ -10,100 +10,601 @@
 #include "slack-message.h"
 #include "slack-channel.h"
 #include "slack-rtm.h"
+#include "slack-rtm-event.h"
+#include "slack-trace.h"
 
-
+#define RTM_RECONNECT_TRIES 10 /* consecutive failed reconnects before giving up */
+#define RTM_RECONNECT_MAX_DELAY 120000 /* ms */
+#define RTM_RECONNECT_JITTER 500 /* ms, at least */
+#define RTM_HANDOVER_TIMEOUT 30 /* s to wait for Slack to close a connection we've replaced */
+#define RTM_SEEN_SLOTS 2048 /* envelopes and events remembered for de-duplication (power of 2) */
+#define RTM_SEEN_PROBE 16 /* slots searched for one: at worst the oldest of these is forgotten */
+#define RTM_SEEN_WINDOW (10*60*G_USEC_PER_SEC) /* slack retries for about 5 minutes */
+#define RTM_CONNS_MAX 10 /* slack's limit per app */
+#define RTM_PING_INTERVAL 30 /* s */
+#define RTM_PING_MISSED 3 /* unanswered pings before we give up on a connection */
+#define RTM_BATCH_DELAY 250 /* ms to collect presence, user and typing changes before applying them */
 
 struct _SlackRTMCall {
 	SlackAccount *sa;
+	PurpleWebsocket *ws; /* sent on */
 	SlackRTMCallback *callback;
 	gpointer data;
 };
 
-static gboolean rtm_msg(SlackAccount *sa, const char *type, json_value *json) {
-	if (!strcmp(type, "message")) {
-		return slack_message(sa, json);
-	}
-	else if (!strcmp(type, "user_typing")) {
-		slack_user_typing(sa, json);
+/* One of our Socket Mode connections: slack spreads events over all of them */
+struct _SlackRTMConn {
+	SlackAccount *sa;
+	PurpleWebsocket *ws; /* the current connection */
+	gboolean hello; /* ws is ready */
+	PurpleWebsocket *next; /* replacing ws, after a disconnect warning */
+	PurpleWebsocket *prev; /* replaced by ws, until Slack closes it */
+	guint prev_timer;
+	gboolean handover; /* asked for next */
+	guint reconnect_timer;
+	guint failures; /* consecutive reconnects without hello */
+	gboolean failed; /* given up on, while others carried on */
+	gint64 ping_sent; /* monotonic time of the unanswered ping on ws, also its payload */
+	guint ping_missed;
+	gint64 rtt, rtt_last; /* us, smoothed and latest */
+};
+
+/* Drop cached API responses the event may have changed */
+static void rtm_invalidate(SlackAccount *sa, const SlackRTMEvent *event, json_value *json) {
+	json_value *chan = json_get_prop(json, "channel");
+	slack_api_cache_invalidate(sa, json_get_strptr(chan) ?: json_get_prop_strptr(chan, "id"));
+	if (event->handler == SLACK_RTM_USER_CHANGE)
+		slack_api_cache_invalidate(sa, json_get_prop_strptr(json_get_prop(json, "user"), "id"));
+}
+
+/* Frequent per-user events, keeping only the latest of each until they're applied together */
+struct _SlackRTMBatch {
+	GHashTable *users; /* char *user id -> json_value *user_change */
+	GHashTable *presence; /* char *user id -> char *presence */
+	GHashTable *typing; /* char *"user channel" -> json_value *user_typing */
+	guint timer;
+};
+
+static void rtm_batch_free(SlackRTMBatch *batch) {
+	if (batch->timer)
+		purple_timeout_remove(batch->timer);
+	g_hash_table_destroy(batch->users);
+	g_hash_table_destroy(batch->presence);
+	g_hash_table_destroy(batch->typing);
+	g_free(batch);
+}
+
+static gboolean rtm_batch_apply(gpointer data) {
+	SlackAccount *sa = data;
+	SlackRTMBatch *batch = sa->rtm_batch;
+	GHashTableIter iter;
+	gpointer key, value;
+	/* anything applied from here on starts a new one */
+	sa->rtm_batch = NULL;
+	batch->timer = 0;
+
+	slack_trace(SLACK_TRACE_RTM, SLACK_TRACE_DEBUG, "applying %u user, %u presence, %u typing changes",
+			g_hash_table_size(batch->users), g_hash_table_size(batch->presence), g_hash_table_size(batch->typing));
+
+	/* users first, as they may be new */
+	g_hash_table_iter_init(&iter, batch->users);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		slack_user_changed(sa, value);
+	g_hash_table_iter_init(&iter, batch->presence);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		slack_presence_set(sa, key, value);
+	g_hash_table_iter_init(&iter, batch->typing);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		slack_user_typing(sa, value);
+
+	rtm_batch_free(batch);
+	return FALSE;
+}
+
+/* Queue up an event to apply along with others shortly, returning TRUE if we kept json */
+static gboolean rtm_batch_add(SlackAccount *sa, const SlackRTMEvent *event, json_value *json) {
+	SlackRTMBatch *batch = sa->rtm_batch;
+	if (!batch) {
+		batch = sa->rtm_batch = g_new0(SlackRTMBatch, 1);
+		batch->users = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)json_value_free);
+		batch->presence = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		batch->typing = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)json_value_free);
+		batch->timer = purple_timeout_add(RTM_BATCH_DELAY, rtm_batch_apply, sa);
 	}
-	else if (!strcmp(type, "presence_change") ||
-	         !strcmp(type, "presence_change_batch")) {
-		slack_presence_change(sa, json);
+
+	switch (event->handler) {
+		case SLACK_RTM_USER_CHANGE: {
+			const char *id = json_get_prop_strptr(json_get_prop(json, "user"), "id");
+			if (!id)
+				return FALSE;
+			g_hash_table_insert(batch->users, g_strdup(id), json);
+			return TRUE;
+		}
+		case SLACK_RTM_PRESENCE_CHANGE: {
+			json_value *users = json_get_prop(json, "users") ?: json_get_prop(json, "user");
+			const char *presence = json_get_prop_strptr(json, "presence");
+			if (!users || !presence)
+				return FALSE;
+			if (users->type == json_array) {
+				unsigned i;
+				for (i = 0; i < users->u.array.length; i++)
+					if (users->u.array.values[i]->type == json_string)
+						g_hash_table_insert(batch->presence, g_strdup(users->u.array.values[i]->u.string.ptr), g_strdup(presence));
+			} else if (users->type == json_string)
+				g_hash_table_insert(batch->presence, g_strdup(users->u.string.ptr), g_strdup(presence));
+			return FALSE;
+		}
+		case SLACK_RTM_USER_TYPING: {
+			const char *user = json_get_prop_strptr(json, "user");
+			const char *channel = json_get_prop_strptr(json, "channel");
+			if (!user || !channel)
+				return FALSE;
+			g_hash_table_insert(batch->typing, g_strconcat(user, " ", channel, NULL), json);
+			return TRUE;
+		}
+		default:
+			g_return_val_if_reached(FALSE);
 	}
-	else if (!strcmp(type, "im_close")) {
-		slack_im_close(sa, json);
+}
+
+static gboolean rtm_msg(SlackAccount *sa, const char *type, json_value *json) {
+	const SlackRTMEvent *event = slack_rtm_event_lookup(type);
+	if (event->flags & SLACK_RTM_INVALIDATE)
+		rtm_invalidate(sa, event, json);
+	if (event->flags & SLACK_RTM_COALESCE)
+		return rtm_batch_add(sa, event, json);
+
+	switch (event->handler) {
+		case SLACK_RTM_MESSAGE:
+			if (sa->rtm_batch) {
+				const char *user = json_get_prop_strptr(json, "user");
+				/* show it from who they are now */
+				json_value *change = user ? g_hash_table_lookup(sa->rtm_batch->users, user) : NULL;
+				if (change) {
+					slack_user_changed(sa, change);
+					g_hash_table_remove(sa->rtm_batch->users, user);
+				}
+				/* they've stopped typing */
+				char *key = g_strconcat(user ?: "", " ", json_get_prop_strptr(json, "channel") ?: "", NULL);
+				g_hash_table_remove(sa->rtm_batch->typing, key);
+				g_free(key);
+			}
+			return slack_message(sa, json);
+		case SLACK_RTM_IM_CLOSE:
+			slack_im_close(sa, json);
+			break;
+		case SLACK_RTM_IM_OPEN:
+			slack_im_open(sa, json);
+			break;
+		case SLACK_RTM_MEMBER_JOINED:
+			slack_member_joined_channel(sa, json, TRUE);
+			break;
+		case SLACK_RTM_MEMBER_LEFT:
+			slack_member_joined_channel(sa, json, FALSE);
+			break;
+		case SLACK_RTM_CHANNEL_MEMBER:
+			slack_channel_update(sa, json, SLACK_CHANNEL_MEMBER);
+			break;
+		case SLACK_RTM_CHANNEL_GROUP:
+			slack_channel_update(sa, json, SLACK_CHANNEL_GROUP);
+			break;
+		case SLACK_RTM_CHANNEL_PUBLIC:
+			slack_channel_update(sa, json, SLACK_CHANNEL_PUBLIC);
+			break;
+		case SLACK_RTM_CHANNEL_UNKNOWN:
+			slack_channel_update(sa, json, SLACK_CHANNEL_UNKNOWN);
+			break;
+		case SLACK_RTM_CHANNEL_DELETED:
+			slack_channel_update(sa, json, SLACK_CHANNEL_DELETED);
+			break;
+		case SLACK_RTM_UNHANDLED:
+			purple_debug_info("slack", "Unhandled RTM type %s\n", type);
+			break;
+		default:
+			/* batched */
+			break;
 	}
-	else if (!strcmp(type, "im_open")) {
-		slack_im_open(sa, json);
-		return TRUE;
+	return (event->flags & SLACK_RTM_KEEPS_JSON) != 0;
+}
+
+static void rtm_reconnect(SlackRTMConn *conn, const char *error);
+static void rtm_handover(SlackRTMConn *conn, PurpleWebsocket *ws, const char *reason);
+static void rtm_conns_open(SlackAccount *sa);
+
+/* Recently received envelopes and events, by hash, in a bounded open-addressed table */
+struct _SlackRTMSeen {
+	struct {
+		guint64 hash; /* 0 if empty */
+		gint64 time;
+	} slot[RTM_SEEN_SLOTS];
+};
+
+/* FNV-1a, continuing from h (or 0) */
+static guint64 rtm_seen_hash(guint64 h, const char *s, size_t len) {
+	if (!h)
+		h = G_GUINT64_CONSTANT(14695981039346656037);
+	while (len--)
+		h = (h ^ (guchar)*s++) * G_GUINT64_CONSTANT(1099511628211);
+	return h;
+}
+
+/* Remember an envelope or event, returning TRUE if we already had it recently */
+static gboolean rtm_seen_key(SlackRTMSeen *seen, guint64 hash, gint64 now) {
+	guint i, slot = RTM_SEEN_SLOTS, oldest = 0;
+	if (!hash)
+		hash = 1;
+
+	for (i = 0; i < RTM_SEEN_PROBE; i++) {
+		guint s = (hash + i) & (RTM_SEEN_SLOTS-1);
+		gboolean live = seen->slot[s].hash && now - seen->slot[s].time < RTM_SEEN_WINDOW;
+		if (live && seen->slot[s].hash == hash)
+			return TRUE;
+		if (!live && slot == RTM_SEEN_SLOTS)
+			slot = s;
+		if (!seen->slot[s].hash)
+			/* it can't be any further on */
+			break;
+		if (i == 0 || seen->slot[s].time < seen->slot[oldest].time)
+			oldest = s;
 	}
-	else if (!strcmp(type, "member_joined_channel")) {
-		slack_member_joined_channel(sa, json, TRUE);
+
+	/* expired entries are reused in place; if there are none nearby, forget the oldest */
+	if (slot == RTM_SEEN_SLOTS)
+		slot = oldest;
+	seen->slot[slot].hash = hash;
+	seen->slot[slot].time = now;
+	return FALSE;
+}
+
+/* Remember all these, returning TRUE if we'd already seen any of them (from a retry or another connection) */
+static gboolean rtm_seen(SlackAccount *sa, const guint64 *keys, guint n) {
+	gint64 now = g_get_monotonic_time();
+	gboolean dup = FALSE;
+	if (!sa->rtm_seen)
+		sa->rtm_seen = g_new0(SlackRTMSeen, 1);
+	while (n--)
+		if (rtm_seen_key(sa->rtm_seen, keys[n], now))
+			dup = TRUE;
+	return dup;
+}
+
+static gboolean rtm_call_sent_on(gpointer key, gpointer value, gpointer ws) {
+	SlackRTMCall *call = value;
+	return call->ws == ws;
+}
+
+/* Nothing will reply to calls sent on ws now */
+static void rtm_calls_cancel(SlackAccount *sa, PurpleWebsocket *ws) {
+	g_hash_table_foreach_remove(sa->rtm_call, rtm_call_sent_on, ws);
+}
+
+static gboolean rtm_prev_timeout(gpointer data) {
+	SlackRTMConn *conn = data;
+	conn->prev_timer = 0;
+	rtm_calls_cancel(conn->sa, conn->prev);
+	purple_websocket_abort(conn->prev);
+	conn->prev = NULL;
+	return FALSE;
+}
+
+static void rtm_hello(SlackRTMConn *conn, PurpleWebsocket *ws) {
+	SlackAccount *sa = conn->sa;
+	conn->failures = 0;
+	conn->hello = TRUE;
+	if (ws == conn->next) {
+		/* switch over: keep the old one until Slack closes it, in case anything else arrives there */
+		if (conn->prev) {
+			rtm_calls_cancel(sa, conn->prev);
+			purple_websocket_abort(conn->prev);
+		}
+		if (conn->prev_timer)
+			purple_timeout_remove(conn->prev_timer);
+		conn->prev = conn->ws;
+		conn->prev_timer = purple_timeout_add_seconds(RTM_HANDOVER_TIMEOUT, rtm_prev_timeout, conn);
+		conn->ws = ws;
+		conn->next = NULL;
+		conn->ping_sent = 0;
+		conn->ping_missed = 0;
+		purple_debug_info("slack", "RTM handed over\n");
 	}
-	else if (!strcmp(type, "member_left_channel")) {
-		slack_member_joined_channel(sa, json, FALSE);
+	else if (purple_connection_get_state(sa->gc) == PURPLE_CONNECTED)
+		purple_debug_info("slack", "RTM reconnected\n");
+	else if (conn == sa->rtm_conns->data)
+		slack_login_step(sa);
+
+	if (((SlackRTMConn *)sa->rtm_conns->data)->hello)
+		rtm_conns_open(sa);
+}
+
+static void rtm_closed(SlackRTMConn *conn, PurpleWebsocket *ws, const char *error) {
+	rtm_calls_cancel(conn->sa, ws);
+	if (ws == conn->prev) {
+		/* as expected */
+		conn->prev = NULL;
+		purple_timeout_remove(conn->prev_timer);
+		conn->prev_timer = 0;
 	}
-	else if (!strcmp(type, "user_change") ||
-		 !strcmp(type, "team_join")) {
-		slack_user_changed(sa, json);
+	else if (ws == conn->next) {
+		/* we'll reconnect when the current one goes, instead */
+		purple_debug_warning("slack", "RTM handover failed: %s\n", error);
+		conn->next = NULL;
+		rtm_conns_open(conn->sa);
 	}
-	else if (!strcmp(type, "im_created")) {
-		/* not necessarily (and probably in reality never) open, but works as no-op in that case */
-		slack_im_open(sa, json);
-		return TRUE;
+	else if (conn->next) {
+		/* closed before its replacement said hello: it will soon */
+		conn->ws = conn->next;
+		conn->hello = FALSE;
+		conn->next = NULL;
+		conn->ping_sent = 0;
+		conn->ping_missed = 0;
 	}
-	else if (!strcmp(type, "channel_joined")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_MEMBER);
+	else {
+		conn->ws = NULL;
+		conn->hello = FALSE;
+		rtm_reconnect(conn, error);
 	}
-	else if (!strcmp(type, "group_joined") ||
-		 !strcmp(type, "group_unarchive")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_GROUP);
+}
+
+/* Past the json string starting at p (at its opening quote), or NULL */
+static const char *rtm_scan_string(const char *p, const char *end) {
+	for (p++; p < end; p++) {
+		if (*p == '\\')
+			p++;
+		else if (*p == '"')
+			return p+1;
 	}
-	else if (!strcmp(type, "channel_left") ||
-	         !strcmp(type, "channel_created") ||
-	         !strcmp(type, "channel_unarchive")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_PUBLIC);
+	return NULL;
+}
+
+/* Past the json value starting at p, or NULL (this doesn't validate it, only finds its end) */
+static const char *rtm_scan_value(const char *p, const char *end) {
+	int depth = 0;
+	while (p < end) {
+		switch (*p) {
+			case '"':
+				if (!(p = rtm_scan_string(p, end)))
+					return NULL;
+				if (!depth)
+					return p;
+				continue;
+			case '{':
+			case '[':
+				depth++;
+				break;
+			case '}':
+			case ']':
+				if (!depth)
+					return p;
+				if (!--depth)
+					return p+1;
+				break;
+			case ',':
+				if (!depth)
+					return p;
+				break;
+		}
+		p++;
 	}
-	else if (!strcmp(type, "channel_rename") ||
-		 !strcmp(type, "group_rename")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_UNKNOWN);
+	return NULL;
+}
+
+#define RTM_SKIP_SPACE(p, end) while (p < end && g_ascii_isspace(*p)) p++
+
+/* Find a property of the json object at p in a raw Socket Mode message without
+ * parsing the rest.  Returns its value as is (for a string, quoted and escaped),
+ * or NULL if it's not simply there or doesn't start with type. */
+static const char *rtm_scan_prop(const char *p, size_t len, const char *name, char type, size_t *value_len) {
+	const char *end = p + len;
+	size_t name_len = strlen(name);
+
+	RTM_SKIP_SPACE(p, end);
+	if (p == end || *p++ != '{')
+		return NULL;
+	for (;;) {
+		RTM_SKIP_SPACE(p, end);
+		if (p == end || *p != '"')
+			return NULL;
+		const char *k = p;
+		if (!(p = rtm_scan_string(p, end)))
+			return NULL;
+		gboolean match = (size_t)(p - k) == name_len+2 && !memcmp(k+1, name, name_len);
+		RTM_SKIP_SPACE(p, end);
+		if (p == end || *p++ != ':')
+			return NULL;
+		RTM_SKIP_SPACE(p, end);
+		const char *v = p;
+		if (!(p = rtm_scan_value(p, end)))
+			return NULL;
+		if (match) {
+			if (*v != type)
+				return NULL;
+			*value_len = p-v;
+			return v;
+		}
+		RTM_SKIP_SPACE(p, end);
+		if (p == end || *p++ != ',')
+			return NULL;
 	}
-	else if (!strcmp(type, "channel_archive") ||
-		 !strcmp(type, "channel_deleted") ||
-		 !strcmp(type, "group_archive") ||
-		 !strcmp(type, "group_left")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_DELETED);
+}
+
+/* Copy the contents of a scanned json string into buf, if it's short and needs no unescaping */
+static gboolean rtm_scan_copy(const char *str, size_t len, char *buf, size_t siz) {
+	if (len < 2 || len-2 >= siz || memchr(str, '\\', len))
+		return FALSE;
+	memcpy(buf, str+1, len-2);
+	buf[len-2] = 0;
+	return TRUE;
+}
+
+/* Handle what we can of a raw message without parsing it: returns TRUE if that's all it needed.
+ * In particular, events we'd do nothing with are dropped here. */
+static gboolean rtm_classify(SlackRTMConn *conn, PurpleWebsocket *ws, const char *msg, size_t len) {
+	SlackAccount *sa = conn->sa;
+	char type[64], arg[64];
+	size_t n, payload_len;
+	const char *v;
+
+	const char *payload = rtm_scan_prop(msg, len, "payload", '{', &payload_len);
+	if (!payload) {
+		/* about the connection itself, outside any envelope */
+		if (!(v = rtm_scan_prop(msg, len, "type", '"', &n)) || !rtm_scan_copy(v, n, type, sizeof(type)))
+			return FALSE;
+		if (!strcmp(type, "hello")) {
+			rtm_hello(conn, ws);
+			return TRUE;
+		}
+		if (!strcmp(type, "disconnect")) {
+			v = rtm_scan_prop(msg, len, "reason", '"', &n);
+			rtm_handover(conn, ws, v && rtm_scan_copy(v, n, arg, sizeof(arg)) ? arg : NULL);
+			return TRUE;
+		}
+		return FALSE;
 	}
-	else if (!strcmp(type, "hello")) {
-		slack_login_step(sa);
+
+	/* as rtm_cb finds it */
+	msg = rtm_scan_prop(payload, payload_len, "event", '{', &len);
+	if (!msg) {
+		msg = payload;
+		len = payload_len;
 	}
-	else {
-		purple_debug_info("slack", "Unhandled RTM type %s\n", type);
+	if (!(v = rtm_scan_prop(msg, len, "type", '"', &n)) || !rtm_scan_copy(v, n, type, sizeof(type)))
+		return FALSE;
+
+	const SlackRTMEvent *event = slack_rtm_event_lookup(type);
+	switch (event->handler) {
+		case SLACK_RTM_UNHANDLED:
+			/* it may still be about a channel we have cached */
+			if ((v = rtm_scan_prop(msg, len, "channel", '{', &n)))
+				v = rtm_scan_prop(v, n, "id", '"', &n);
+			else
+				v = rtm_scan_prop(msg, len, "channel", '"', &n);
+			if (v && rtm_scan_copy(v, n, arg, sizeof(arg)))
+				slack_api_cache_invalidate(sa, arg);
+			else if (v)
+				/* we can't tell which */
+				return FALSE;
+			purple_debug_info("slack", "Unhandled RTM type %s\n", type);
+			return TRUE;
+		case SLACK_RTM_PRESENCE_CHANGE: {
+			/* only buddies show presence: drop it if it's about none of them */
+			const char *end;
+			if ((v = rtm_scan_prop(msg, len, "users", '[', &n))) {
+				end = v + n - 1;
+				v++;
+			} else if ((v = rtm_scan_prop(msg, len, "user", '"', &n)))
+				end = v + n;
+			else
+				return FALSE;
+			for (;;) {
+				RTM_SKIP_SPACE(v, end);
+				if (v == end)
+					return TRUE;
+				const char *s = v;
+				if (*s != '"' || !(v = rtm_scan_string(s, end)) || !rtm_scan_copy(s, v - s, arg, sizeof(arg)))
+					return FALSE;
+				SlackUser *user = (SlackUser*)slack_object_hash_table_lookup(sa->users, arg);
+				if (user && user->object.buddy)
+					return FALSE;
+				RTM_SKIP_SPACE(v, end);
+				if (v < end && *v == ',')
+					v++;
+			}
+		}
+		default:
+			return FALSE;
 	}
-	return FALSE;
+}
+
+/* Acknowledge an envelope, ahead of anything else we're sending: Slack redelivers it if that takes 3s */
+static void rtm_ack(PurpleWebsocket *ws, const char *env_id_json, size_t len) {
+	GString *ack = g_string_sized_new(len + 20);
+	g_string_append(ack, "{\"envelope_id\":");
+	g_string_append_len(ack, env_id_json, len);
+	g_string_append_c(ack, '}');
+	purple_websocket_send_first(ws, PURPLE_WEBSOCKET_TEXT, (guchar*)ack->str, ack->len);
+	g_string_free(ack, TRUE);
+}
+
+/* A reply to our last ping on ws, with its timestamp */
+static void rtm_pong(SlackRTMConn *conn, const guchar *msg, size_t len) {
+	gint64 sent;
+	if (len != sizeof(sent))
+		return;
+	memcpy(&sent, msg, sizeof(sent));
+	if (!conn->ping_sent || sent != conn->ping_sent)
+		/* stale */
+		return;
+
+	conn->rtt_last = g_get_monotonic_time() - sent;
+	/* as TCP does (RFC 6298) */
+	conn->rtt = conn->rtt ? conn->rtt + (conn->rtt_last - conn->rtt) / 8 : conn->rtt_last;
+	conn->ping_sent = 0;
+	conn->ping_missed = 0;
 }
 
 static void rtm_cb(PurpleWebsocket *ws, gpointer data, PurpleWebsocketOp op, const guchar *msg, size_t len) {
-	SlackAccount *sa = data;
+	SlackRTMConn *conn = data;
+	SlackAccount *sa = conn->sa;
 
-	purple_debug_misc("slack", "RTM %x: %.*s\n", op, (int)len, msg);
-	printf("RTM %x: %.*s\n", op, (int)len, msg);
+	if (ws != conn->ws && ws != conn->next && ws != conn->prev)
+		/* one we've given up on, finishing closing */
+		return;
+
+	if (op == PURPLE_WEBSOCKET_TEXT)
+		slack_trace_payload(SLACK_TRACE_RTM, "recv", (const char *)msg, len);
+	else
+		slack_trace(SLACK_TRACE_RTM, SLACK_TRACE_INFO, "websocket op %x: %.*s", op, (int)len, msg ? (const char *)msg : "");
 	switch (op) {
 		case PURPLE_WEBSOCKET_TEXT:
 			break;
 		case PURPLE_WEBSOCKET_ERROR:
-		case PURPLE_WEBSOCKET_CLOSE:
-			purple_connection_error_reason(sa->gc,
-					PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-					(const char *)msg ?: "RTM connection closed");
-			sa->rtm = NULL;
-			break;
+		case PURPLE_WEBSOCKET_CLOSE: {
+			/* the websocket goes away on its own */
+			char *error = op == PURPLE_WEBSOCKET_ERROR && msg ? g_strndup((const char *)msg, len) : g_strdup("RTM connection closed");
+			rtm_closed(conn, ws, error);
+			g_free(error);
+			return;
+		}
 		case PURPLE_WEBSOCKET_OPEN:
-			slack_login_step(sa);
+			if (ws == conn->ws && conn == sa->rtm_conns->data && purple_connection_get_state(sa->gc) != PURPLE_CONNECTED)
+				slack_login_step(sa);
+			return;
+		case PURPLE_WEBSOCKET_PONG:
+			if (ws == conn->ws)
+				rtm_pong(conn, msg, len);
 		default:
 			return;
 	}
 
+	/* before spending any time on it */
+	size_t early_len, payload_len, event_len, v_len, ts_len;
+	const char *early_id = rtm_scan_prop((const char *)msg, len, "envelope_id", '"', &early_len);
+	if (early_id) {
+		guint64 keys[2];
+		guint n = 0;
+		rtm_ack(ws, early_id, early_len);
+
+		/* retries come in new envelopes, so also the event, or failing that, the message */
+		keys[n++] = rtm_seen_hash(0, early_id, early_len);
+		const char *payload = rtm_scan_prop((const char *)msg, len, "payload", '{', &payload_len);
+		const char *v = payload ? rtm_scan_prop(payload, payload_len, "event_id", '"', &v_len) : NULL;
+		const char *event = payload && !v ? rtm_scan_prop(payload, payload_len, "event", '{', &event_len) : NULL;
+		if (v)
+			keys[n++] = rtm_seen_hash(0, v, v_len);
+		else if (event && (v = rtm_scan_prop(event, event_len, "type", '"', &v_len)) && v_len == 9 && !memcmp(v, "\"message\"", 9)) {
+			const char *ts = rtm_scan_prop(event, event_len, "ts", '"', &ts_len);
+			if (ts && (v = rtm_scan_prop(event, event_len, "channel", '"', &v_len)))
+				keys[n++] = rtm_seen_hash(rtm_seen_hash(0, v, v_len), ts, ts_len);
+		}
+
+		if (rtm_seen(sa, keys, n)) {
+			slack_trace(SLACK_TRACE_RTM, SLACK_TRACE_INFO, "duplicate envelope %.*s", (int)early_len, early_id);
+			return;
+		}
+	}
+
+	if (rtm_classify(conn, ws, (const char *)msg, len))
+		return;
 
 	json_value *json_wrapper = json_parse((const char *)msg, len);
 	const char *env_id = json_get_prop_strptr( json_wrapper, "envelope_id" );
@@ -118,12 +619,38 @@ static void rtm_cb(PurpleWebsocket *ws, gpointer data, PurpleWebsocketOp op, con
 	json_value *reply_to = json_get_prop_type(json, "reply_to", integer);
 	const char *type = json_get_prop_strptr(json, "type");
 
+	if (json == json_wrapper && type && !strcmp(type, "hello")) {
+		rtm_hello(conn, ws);
+		json_value_free(json_wrapper);
+		return;
+	}
+	if (json == json_wrapper && type && !strcmp(type, "disconnect")) {
+		rtm_handover(conn, ws, json_get_prop_strptr(json, "reason"));
+		json_value_free(json_wrapper);
+		return;
+	}
+
+	if (env_id && !early_id) {
+		/* the scanner couldn't manage it: same again, slowly */
+		GString *id = append_json_string(g_string_new(NULL), env_id);
+		guint64 keys[2];
+		guint n = 0;
+		rtm_ack(ws, id->str, id->len);
+		keys[n++] = rtm_seen_hash(0, id->str, id->len);
+
+		const char *event_id = json_get_prop_strptr(json_get_prop(json_wrapper, "payload"), "event_id");
+		if (event_id) {
+			g_string_truncate(id, 0);
+			append_json_string(id, event_id);
+			keys[n++] = rtm_seen_hash(0, id->str, id->len);
+		}
+		g_string_free(id, TRUE);
 
-	if ( sa->rtm ) {
-		GString *response_json = g_string_new(NULL);
-		g_string_printf(response_json, "{\"envelope_id\":\"%s\"", env_id);
-		purple_websocket_send(sa->rtm, PURPLE_WEBSOCKET_TEXT, (guchar*)response_json->str, response_json->len);
-		g_string_free(response_json, TRUE);
+		if (rtm_seen(sa, keys, n)) {
+			slack_trace(SLACK_TRACE_RTM, SLACK_TRACE_INFO, "duplicate envelope %s", env_id);
+			json_value_free(json_wrapper);
+			return;
+		}
 	}
 
 
@@ -163,13 +690,27 @@ static gboolean ping_timer(gpointer data) {
 	PurplePresence *pres = purple_account_get_presence(sa->account);
 	if (pres && purple_presence_get_idle_time(pres) == 0)
 		slack_rtm_send(sa, NULL, NULL, "tickle", NULL);
-	else
-		/* we don't care about the response (at this point) so just send a uni-directional PONG */
-		purple_websocket_send(sa->rtm, PURPLE_WEBSOCKET_PONG, NULL, 0);
+
+	/* a half-open connection looks fine until we find nothing answers */
+	GSList *l;
+	for (l = sa->rtm_conns; l; l = l->next) {
+		SlackRTMConn *conn = l->data;
+		if (!conn->hello)
+			continue;
+		if (conn->ping_sent && ++conn->ping_missed >= RTM_PING_MISSED) {
+			PurpleWebsocket *ws = conn->ws;
+			purple_debug_warning("slack", "RTM: no response to %u pings\n", conn->ping_missed);
+			purple_websocket_abort(ws);
+			rtm_closed(conn, ws, "RTM connection timed out");
+			continue;
+		}
+		/* if the last one is still unanswered, this one replaces it: later pongs tell us nothing more */
+		conn->ping_sent = g_get_monotonic_time();
+		purple_websocket_send(conn->ws, PURPLE_WEBSOCKET_PING, (const guchar *)&conn->ping_sent, sizeof(conn->ping_sent));
+	}
 	return TRUE;
 }
 
-
 static gboolean get_self_cb2(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
 	if (error) {
 		purple_connection_error_reason(sa->gc, slack_api_connection_error(error), error);
@@ -194,15 +735,173 @@ static gboolean get_self_cb1(SlackAccount *sa, gpointer data, json_value *json,
 	slack_api_post(sa, get_self_cb2, NULL, "users.info", "user", user_id, NULL);
 	return TRUE;
 }
+
+static PurpleWebsocket *rtm_websocket(SlackRTMConn *conn, const char *url) {
+	SlackAccount *sa = conn->sa;
+	gchar *cookie = NULL;
+	if (sa->d_cookie)
+		cookie = g_strconcat("d=", sa->d_cookie, NULL);
+
+	if (slack_trace_enabled(SLACK_TRACE_RTM, SLACK_TRACE_INFO)) {
+		GString *redacted = slack_trace_redact(url, strlen(url), 0);
+		slack_trace_log(SLACK_TRACE_RTM, SLACK_TRACE_INFO, "connecting to %s", redacted->str);
+		g_string_free(redacted, TRUE);
+	}
+	PurpleWebsocket *ws = purple_websocket_connect(sa->account, url, NULL, cookie, rtm_cb, conn);
+
+	g_free(cookie);
+	return ws;
+}
+
+static void rtm_open(SlackRTMConn *conn, const char *url) {
+	conn->hello = FALSE;
+	conn->ping_sent = 0;
+	conn->ping_missed = 0;
+	conn->ws = rtm_websocket(conn, url);
+	if (!conn->ws)
+		rtm_reconnect(conn, "Unable to connect to websocket");
+}
+
+static gboolean rtm_reconnect_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+	SlackRTMConn *conn = data;
+	if (!sa->rtm_call)
+		/* disconnected meanwhile */
+		return FALSE;
+
+	const char *url = json_get_prop_strptr(json, "url");
+	if (error || !url)
+		rtm_reconnect(conn, error ?: "Missing RTM parameters");
+	else
+		rtm_open(conn, url);
+	return FALSE;
+}
+
+static gboolean rtm_reconnect_timer(gpointer data) {
+	SlackRTMConn *conn = data;
+	conn->reconnect_timer = 0;
+	slack_api_post_as_app(conn->sa, rtm_reconnect_cb, conn, "apps.connections.open", "batch_presence_aware", "1", "presence_sub", "true", NULL);
+	return FALSE;
+}
+
+/* This connection is gone: get a new one, without disturbing anything else
+ * (Slack closes connections routinely), backing off if that keeps failing */
+static void rtm_reconnect(SlackRTMConn *conn, const char *error) {
+	SlackAccount *sa = conn->sa;
+
+	if (conn == sa->rtm_conns->data && purple_connection_get_state(sa->gc) != PURPLE_CONNECTED) {
+		purple_connection_error_reason(sa->gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error);
+		return;
+	}
+	if (++conn->failures > RTM_RECONNECT_TRIES) {
+		/* only the last one standing takes the account down with it */
+		GSList *l;
+		for (l = sa->rtm_conns; l && !((SlackRTMConn *)l->data)->hello; l = l->next);
+		if (!l) {
+			purple_connection_error_reason(sa->gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error);
+			return;
+		}
+		purple_debug_warning("slack", "RTM connection given up after %u attempts: %s\n", RTM_RECONNECT_TRIES, error);
+		conn->failed = TRUE;
+		return;
+	}
+
+	guint delay = 0;
+	if (conn->failures > 1)
+		delay = MIN(1000u << MIN(conn->failures - 2, 8), RTM_RECONNECT_MAX_DELAY);
+	/* so everyone disconnected at once doesn't come back at once */
+	delay += g_random_int_range(0, delay/2 + RTM_RECONNECT_JITTER);
+
+	purple_debug_info("slack", "RTM reconnecting in %ums (attempt %u): %s\n", delay, conn->failures, error);
+	conn->reconnect_timer = purple_timeout_add(delay, rtm_reconnect_timer, conn);
+}
+
+static gboolean rtm_handover_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+	SlackRTMConn *conn = data;
+	if (!sa->rtm_call)
+		/* disconnected meanwhile */
+		return FALSE;
+	conn->handover = FALSE;
+
+	const char *url = json_get_prop_strptr(json, "url");
+	if (error || !url) {
+		/* we'll reconnect when the current one goes, instead */
+		purple_debug_warning("slack", "RTM handover failed: %s\n", error ?: "Missing RTM parameters");
+		rtm_conns_open(sa);
+		return FALSE;
+	}
+
+	if (conn->ws)
+		conn->next = rtm_websocket(conn, url);
+	else if (conn->reconnect_timer) {
+		/* already gone: no need to wait */
+		purple_timeout_remove(conn->reconnect_timer);
+		conn->reconnect_timer = 0;
+		rtm_open(conn, url);
+	}
+	return FALSE;
+}
+
+/* Slack is about to close this connection: open another first, so nothing is missed */
+static void rtm_handover(SlackRTMConn *conn, PurpleWebsocket *ws, const char *reason) {
+	purple_debug_info("slack", "RTM disconnect warning: %s\n", reason ?: "");
+	if (ws != conn->ws || conn->next || conn->handover || !g_strcmp0(reason, "link_disabled"))
+		return;
+
+	conn->handover = TRUE;
+	slack_api_post_as_app(conn->sa, rtm_handover_cb, conn, "apps.connections.open", "batch_presence_aware", "1", "presence_sub", "true", NULL);
+}
+
+static SlackRTMConn *rtm_conn_new(SlackAccount *sa) {
+	SlackRTMConn *conn = g_new0(SlackRTMConn, 1);
+	conn->sa = sa;
+	return conn;
+}
+
+static void rtm_conn_free(SlackRTMConn *conn) {
+	if (conn->reconnect_timer)
+		purple_timeout_remove(conn->reconnect_timer);
+	if (conn->prev_timer)
+		purple_timeout_remove(conn->prev_timer);
+	if (conn->ws)
+		purple_websocket_abort(conn->ws);
+	if (conn->next)
+		purple_websocket_abort(conn->next);
+	if (conn->prev)
+		purple_websocket_abort(conn->prev);
+	g_free(conn);
+}
+
+/* Open another of the connections we want beyond the one we logged in with: each one's hello opens the next */
+static void rtm_conns_open(SlackAccount *sa) {
+	int n = CLAMP(purple_account_get_int(sa->account, "rtm_connections", 1), 1, RTM_CONNS_MAX);
+	if (g_slist_length(sa->rtm_conns) >= (guint)n)
+		return;
+
+	/* one at a time, and not while any is being (re)opened: those come first */
+	GSList *l;
+	for (l = sa->rtm_conns; l; l = l->next) {
+		SlackRTMConn *conn = l->data;
+		if (!conn->failed && (!conn->hello || conn->handover || conn->next))
+			return;
+	}
+
+	SlackRTMConn *conn = rtm_conn_new(sa);
+	sa->rtm_conns = g_slist_append(sa->rtm_conns, conn);
+	rtm_reconnect_timer(conn);
+}
+
 static gboolean rtm_connect_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
 	if (error) {
 		purple_connection_error_reason(sa->gc, slack_api_connection_error(error), error);
 		return FALSE;
 	}
 
-	if (sa->rtm) {
-		purple_websocket_abort(sa->rtm);
-		sa->rtm = NULL;
+	if (!sa->rtm_conns)
+		sa->rtm_conns = g_slist_append(sa->rtm_conns, rtm_conn_new(sa));
+	SlackRTMConn *conn = sa->rtm_conns->data;
+	if (conn->ws) {
+		purple_websocket_abort(conn->ws);
+		conn->ws = NULL;
 	}
 
 	const char *url     = json_get_prop_strptr(json, "url");
@@ -238,17 +937,9 @@ static gboolean rtm_connect_cb(SlackAccount *sa, gpointer data, json_value *json
 
 	slack_login_step(sa);
 
-	gchar *cookie = NULL;
-	if (sa->d_cookie)
-		cookie = g_strconcat("d=", sa->d_cookie, NULL);
-
-	purple_debug_info("slack", "RTM URL: %s\n", url);
-	printf("RTM URL: %s\n", url);
-	sa->rtm = purple_websocket_connect(sa->account, url, NULL, cookie, rtm_cb, sa);
-
-	g_free(cookie);
-
-	sa->ping_timer = purple_timeout_add_seconds(60, ping_timer, sa);
+	rtm_open(conn, url);
+	if (!sa->ping_timer)
+		sa->ping_timer = purple_timeout_add_seconds(RTM_PING_INTERVAL, ping_timer, sa);
 	return FALSE;
 }
 
@@ -259,7 +950,18 @@ void slack_rtm_cancel(SlackRTMCall *call) {
 }
 
 void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_data, const char *type, ...) {
-	g_return_if_fail(sa->rtm);
+	/* always the first ready one, so sends stay in order */
+	SlackRTMConn *conn = NULL;
+	GSList *l;
+	for (l = sa->rtm_conns; l && !conn; l = l->next)
+		if (((SlackRTMConn *)l->data)->hello)
+			conn = l->data;
+	if (!conn) {
+		/* reconnecting */
+		if (callback)
+			callback(sa, user_data, NULL, "Not connected");
+		return;
+	}
 	guint id = ++sa->rtm_id;
 
 	GString *json = g_string_new(NULL);
@@ -275,20 +977,60 @@ void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_
 	g_string_append_c(json, '}');
 	g_return_if_fail(json->len <= 16384);
 
-	purple_debug_misc("slack", "RTM: %.*s\n", (int)json->len, json->str);
+	slack_trace_payload(SLACK_TRACE_RTM, "send", json->str, json->len);
 
 	if (callback) {
 		SlackRTMCall *call = g_new(SlackRTMCall, 1);
 		call->sa = sa;
+		call->ws = conn->ws;
 		call->callback = callback;
 		call->data = user_data;
 		g_hash_table_insert(sa->rtm_call, GUINT_TO_POINTER(id), call);
 	}
 
-	purple_websocket_send(sa->rtm, PURPLE_WEBSOCKET_TEXT, (guchar*)json->str, json->len);
+	purple_websocket_send(conn->ws, PURPLE_WEBSOCKET_TEXT, (guchar*)json->str, json->len);
 	g_string_free(json, TRUE);
 }
 
 void slack_rtm_connect(SlackAccount *sa) {
 	slack_api_post_as_app(sa, rtm_connect_cb, NULL, "apps.connections.open", "batch_presence_aware", "1", "presence_sub", "true", NULL);
 }
+
+void slack_rtm_stats(SlackAccount *sa, GString *out) {
+	GSList *l;
+	unsigned i = 0;
+	for (l = sa->rtm_conns; l; l = l->next) {
+		SlackRTMConn *conn = l->data;
+		g_string_append_printf(out, "\nRTM connection %u: ", ++i);
+		if (conn->failed)
+			g_string_append(out, "given up");
+		else if (!conn->hello)
+			g_string_append(out, "connecting");
+		else if (!conn->rtt)
+			g_string_append(out, "connected");
+		else
+			g_string_append_printf(out, "RTT %" G_GINT64_FORMAT "ms (last %" G_GINT64_FORMAT "ms)", conn->rtt / 1000, conn->rtt_last / 1000);
+		if (conn->ping_missed)
+			g_string_append_printf(out, ", %u pings unanswered", conn->ping_missed);
+		if (conn->failures)
+			g_string_append_printf(out, ", %u failed reconnects", conn->failures);
+	}
+}
+
+void slack_rtm_disconnect(SlackAccount *sa) {
+	if (sa->ping_timer) {
+		purple_timeout_remove(sa->ping_timer);
+		sa->ping_timer = 0;
+	}
+
+	g_slist_free_full(sa->rtm_conns, (GDestroyNotify)rtm_conn_free);
+	sa->rtm_conns = NULL;
+	g_hash_table_destroy(sa->rtm_call);
+	sa->rtm_call = NULL;
+
+	g_free(sa->rtm_seen);
+	sa->rtm_seen = NULL;
+	if (sa->rtm_batch)
+		rtm_batch_free(sa->rtm_batch);
+	sa->rtm_batch = NULL;
+}
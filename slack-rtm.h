@@ -9,8 +9,12 @@ typedef struct _SlackRTMCall SlackRTMCall;
 typedef void SlackRTMCallback(SlackAccount *sa, gpointer user_data, json_value *json, const char *error);
 
 void slack_rtm_connect(SlackAccount *sa);
+/* Close the connection for good */
+void slack_rtm_disconnect(SlackAccount *sa);
 /* Send an RTM message of the given type (unquoted, escaped json string) with the given key (unquoted, escaped json string), value (const char *json) pairs */
 void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_data, const char *type, /* const char *key1, const char *json1, */ ...) G_GNUC_NULL_TERMINATED;
 void slack_rtm_cancel(SlackRTMCall *call);
+/* Append connection state and round-trip times, for /slackstats */
+void slack_rtm_stats(SlackAccount *sa, GString *out);
 
 #endif
@@ -0,0 +1,111 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <debug.h>
+
+#include "slack-trace.h"
+
+static const char *const trace_category_names[SLACK_TRACE_CATEGORIES] = {
+	[SLACK_TRACE_API]	= "api",
+	[SLACK_TRACE_RTM]	= "rtm",
+	[SLACK_TRACE_OBJECT]	= "object",
+};
+
+/* all SLACK_TRACE_NONE unless SLACK_TRACE turns them on */
+guint8 slack_trace_levels[SLACK_TRACE_CATEGORIES];
+
+static unsigned trace_sample = 1; /* log every nth payload */
+static gsize trace_truncate = 1024; /* bytes of each payload */
+static unsigned trace_payloads[SLACK_TRACE_CATEGORIES];
+
+/* "category:level,...", where category may also be "all", "sample" or "truncate" */
+void slack_trace_init(const char *config) {
+	if (!config)
+		return;
+	gchar **items = g_strsplit(config, ",", 0);
+	for (gchar **item = items; *item; item++) {
+		char *val = strchr(*item, ':') ?: strchr(*item, '=');
+		if (!val)
+			continue;
+		*val++ = '\0';
+		unsigned n = strtoul(val, NULL, 10);
+		if (!strcmp(*item, "sample"))
+			trace_sample = MAX(n, 1);
+		else if (!strcmp(*item, "truncate"))
+			trace_truncate = n;
+		else for (unsigned c = 0; c < SLACK_TRACE_CATEGORIES; c++)
+			if (!strcmp(*item, "all") || !strcmp(*item, trace_category_names[c]))
+				slack_trace_levels[c] = MIN(n, SLACK_TRACE_PAYLOAD);
+	}
+	g_strfreev(items);
+}
+
+void slack_trace_log(SlackTraceCategory cat, SlackTraceLevel level, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	char *msg = g_strdup_vprintf(fmt, args);
+	va_end(args);
+	purple_debug(level == SLACK_TRACE_INFO ? PURPLE_DEBUG_INFO : PURPLE_DEBUG_MISC, "slack", "%s: %s\n", trace_category_names[cat], msg);
+	g_free(msg);
+}
+
+/* prefixes of things to hide, with the characters that may follow */
+static const struct trace_secret {
+	const char *prefix;
+	gsize keep; /* of prefix, to show what it was */
+} trace_secrets[] = {
+	{ "xox",	5 }, /* xoxb-, xoxc-, xoxd-, xoxp-, etc. tokens and cookies */
+	{ "xapp-",	5 },
+	{ "ticket=",	7 },
+};
+
+static gboolean trace_secret_char(char c) {
+	return g_ascii_isalnum(c) || c == '-' || c == '%' || c == '.' || c == '_';
+}
+
+GString *slack_trace_redact(const char *buf, gsize len, gsize max) {
+	gboolean truncated = max && len > max;
+	if (truncated)
+		len = max;
+	GString *out = g_string_sized_new(len + 32);
+	const char *end = buf + len;
+	const char *run = buf; /* start of unredacted text */
+	for (const char *p = buf; p < end; p++) {
+		if (*p != 'x' && *p != 't')
+			continue;
+		for (unsigned i = 0; i < G_N_ELEMENTS(trace_secrets); i++) {
+			const struct trace_secret *s = &trace_secrets[i];
+			gsize plen = strlen(s->prefix);
+			if ((gsize)(end - p) < plen || strncmp(p, s->prefix, plen))
+				continue;
+			const char *q = p + plen;
+			while (q < end && trace_secret_char(*q))
+				q++;
+			if (q <= p + s->keep)
+				/* nothing (secret) after the prefix */
+				continue;
+			g_string_append_len(out, run, p + s->keep - run);
+			g_string_append(out, "xxx");
+			run = q;
+			p = q - 1;
+			break;
+		}
+	}
+	g_string_append_len(out, run, end - run);
+	if (truncated)
+		g_string_append(out, "...");
+	return out;
+}
+
+void slack_trace_log_payload(SlackTraceCategory cat, const char *what, const char *buf, gssize len) {
+	if (trace_payloads[cat]++ % trace_sample)
+		return;
+	if (!buf)
+		buf = "";
+	if (len < 0)
+		len = strlen(buf);
+	GString *out = slack_trace_redact(buf, len, trace_truncate);
+	purple_debug_misc("slack", "%s: %s (%" G_GSSIZE_FORMAT " bytes): %s\n", trace_category_names[cat], what, len, out->str);
+	g_string_free(out, TRUE);
+}
@@ -0,0 +1,46 @@
+#ifndef _PURPLE_SLACK_TRACE_H
+#define _PURPLE_SLACK_TRACE_H
+
+#include <glib.h>
+
+/* Debug tracing, by category and level.
+ * Configured by the SLACK_TRACE environment variable (see README), and otherwise just a test of a global when disabled. */
+
+typedef enum {
+	SLACK_TRACE_API, /* Web API calls */
+	SLACK_TRACE_RTM, /* websocket events */
+	SLACK_TRACE_OBJECT, /* users, channels, ims */
+	SLACK_TRACE_CATEGORIES
+} SlackTraceCategory;
+
+typedef enum {
+	SLACK_TRACE_NONE,
+	SLACK_TRACE_INFO, /* one line per call, event, etc. */
+	SLACK_TRACE_DEBUG, /* more detail */
+	SLACK_TRACE_PAYLOAD, /* (sampled, truncated, redacted) request and response bodies */
+} SlackTraceLevel;
+
+extern guint8 slack_trace_levels[SLACK_TRACE_CATEGORIES];
+
+#define slack_trace_enabled(CAT, LEVEL) \
+	G_UNLIKELY(slack_trace_levels[CAT] >= (LEVEL))
+
+#define slack_trace(CAT, LEVEL, FMT, ARGS...) do { \
+		if (slack_trace_enabled(CAT, LEVEL)) \
+			slack_trace_log(CAT, LEVEL, FMT, ##ARGS); \
+	} while (0)
+
+/* Log a payload (not nul-terminated, len may be -1) at SLACK_TRACE_PAYLOAD */
+#define slack_trace_payload(CAT, WHAT, BUF, LEN) do { \
+		if (slack_trace_enabled(CAT, SLACK_TRACE_PAYLOAD)) \
+			slack_trace_log_payload(CAT, WHAT, BUF, LEN); \
+	} while (0)
+
+void slack_trace_init(const char *config);
+void slack_trace_log(SlackTraceCategory cat, SlackTraceLevel level, const char *fmt, ...) G_GNUC_PRINTF(3, 4);
+void slack_trace_log_payload(SlackTraceCategory cat, const char *what, const char *buf, gssize len);
+
+/* Copy of buf (truncated to max bytes, if non-zero) with tokens and other secrets replaced by "xxx" */
+GString *slack_trace_redact(const char *buf, gsize len, gsize max);
+
+#endif
@@ -6,6 +6,7 @@
 #include "slack-thread.h"
 #include "slack-user.h"
 #include "slack-im.h"
+#include "slack-trace.h"
 
 G_DEFINE_TYPE(SlackUser, slack_user, SLACK_TYPE_OBJECT);
 
@@ -41,7 +42,7 @@ SlackUser *slack_user_set(SlackAccount *sa, const char *sid, const char *name) {
 	}
 
 	if (g_strcmp0(user->object.name, name)) {
-		purple_debug_misc("slack", "user %s: %s\n", sid, name);
+		slack_trace(SLACK_TRACE_OBJECT, SLACK_TRACE_DEBUG, "user %s: %s", sid, name);
 
 		if (user->object.name)
 			g_hash_table_remove(sa->user_names, user->object.name);
@@ -107,20 +108,21 @@ void slack_user_changed(SlackAccount *sa, json_value *json) {
 	slack_user_update(sa, json_get_prop(json, "user"));
 }
 
+static void users_list_member_cb(SlackAccount *sa, gpointer data, json_value *member) {
+	slack_user_update(sa, member);
+}
+
 static gboolean users_list_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
-	json_value *members = json_get_prop_type(json, "members", array);
-	if (!members) {
+	/* members were already streamed to users_list_member_cb */
+	if (!json_get_prop_type(json, "members", array)) {
 		purple_connection_error_reason(sa->gc,
 				PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing user list");
 		return FALSE;
 	}
 
-	for (unsigned i = 0; i < members->u.array.length; i ++)
-		slack_user_update(sa, members->u.array.values[i]);
-
 	char *cursor = json_get_prop_strptr1(json_get_prop(json, "response_metadata"), "next_cursor");
 	if (cursor)
-		slack_api_post(sa, users_list_cb, NULL, "users.list", "presence", "false", SLACK_PAGINATE_LIMIT_ARG, "cursor", cursor, NULL);
+		slack_api_post_stream(sa, "members", users_list_member_cb, users_list_cb, NULL, "users.list", "presence", "false", SLACK_PAGINATE_LIMIT_ARG, "cursor", cursor, NULL);
 	else
 		slack_login_step(sa);
 	return FALSE;
@@ -128,41 +130,65 @@ static gboolean users_list_cb(SlackAccount *sa, gpointer data, json_value *json,
 
 void slack_users_load(SlackAccount *sa) {
 	// g_hash_table_remove_all(sa->users); /* this isn't really necessary, and we'd prefer to preserve self */
-	slack_api_post(sa, users_list_cb, NULL, "users.list", "presence", "false", SLACK_PAGINATE_LIMIT_ARG, NULL);
+	slack_api_post_stream(sa, "members", users_list_member_cb, users_list_cb, NULL, "users.list", "presence", "false", SLACK_PAGINATE_LIMIT_ARG, NULL);
 }
 
-struct user_retrieve {
+struct user_retrieve_waiter {
 	SlackUserCallback *cb;
 	gpointer data;
 };
 
+/* A single users.info call shared by everyone waiting on the same user */
+struct user_retrieve {
+	char *uid;
+	GSList *waiters; /* struct user_retrieve_waiter, most recent first */
+};
+
 static gboolean user_retrieve_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
 	struct user_retrieve *lookup = data;
+	g_hash_table_remove(sa->user_lookups, lookup->uid);
+
 	json_value *user = json_get_prop_type(json, "user", object);
 	SlackUser *obj = NULL;
 	if (!user || error)
 		purple_debug_error("slack", "Error retrieving user: %s\n", error ?: "missing");
 	else
 		obj = slack_user_update(sa, user);
-	lookup->cb(sa, lookup->data, obj);
+
+	lookup->waiters = g_slist_reverse(lookup->waiters);
+	for (GSList *l = lookup->waiters; l; l = l->next) {
+		struct user_retrieve_waiter *w = l->data;
+		w->cb(sa, w->data, obj);
+		g_free(w);
+	}
+	g_slist_free(lookup->waiters);
+	g_free(lookup->uid);
 	g_free(lookup);
 	return FALSE;
 }
 
 void slack_user_retrieve(SlackAccount *sa, const char *uid, SlackUserCallback *cb, gpointer data) {
 	SlackUser *user = (SlackUser *)slack_object_hash_table_lookup(sa->users, uid);
-	if (user && !uid)
+	if (user || !uid)
 		return cb(sa, data, user);
-	struct user_retrieve *lookup = g_new(struct user_retrieve, 1);
-	lookup->cb = cb;
-	lookup->data = data;
+
+	struct user_retrieve_waiter *w = g_new(struct user_retrieve_waiter, 1);
+	w->cb = cb;
+	w->data = data;
+
+	struct user_retrieve *lookup = g_hash_table_lookup(sa->user_lookups, uid);
+	if (lookup) {
+		lookup->waiters = g_slist_prepend(lookup->waiters, w);
+		return;
+	}
+	lookup = g_new0(struct user_retrieve, 1);
+	lookup->uid = g_strdup(uid);
+	lookup->waiters = g_slist_prepend(NULL, w);
+	g_hash_table_insert(sa->user_lookups, lookup->uid, lookup);
 	slack_api_post(sa, user_retrieve_cb, lookup, "users.info", "user", uid, NULL);
 }
 
-static void presence_set(SlackAccount *sa, json_value *json, const char *presence) {
-	if (json->type != json_string)
-		return;
-	const char *id = json->u.string.ptr;
+void slack_presence_set(SlackAccount *sa, const char *id, const char *presence) {
 	SlackUser *user = (SlackUser*)slack_object_hash_table_lookup(sa->users, id);
 	if (!user || !user->object.name)
 		return;
@@ -170,21 +196,6 @@ static void presence_set(SlackAccount *sa, json_value *json, const char *presenc
 	purple_prpl_got_user_status(sa->account, user->object.name, presence, NULL);
 }
 
-void slack_presence_change(SlackAccount *sa, json_value *json) {
-	json_value *users = json_get_prop(json, "users");
-	if (!users)
-		users = json_get_prop(json, "user");
-	const char *presence = json_get_prop_strptr(json, "presence");
-	if (!users || !presence)
-		return;
-
-	if (users->type == json_array)
-		for (unsigned i = 0; i < users->u.array.length; i ++)
-			presence_set(sa, users->u.array.values[i], presence);
-	else
-		presence_set(sa, users, presence);
-}
-
 char *slack_status_text(PurpleBuddy *buddy) {
 	SlackAccount *sa;
 	SlackObject *obj = slack_blist_node_get_obj(PURPLE_BLIST_NODE(buddy), &sa);
@@ -263,7 +274,7 @@ static gboolean users_info_cb(SlackAccount *sa, gpointer data, json_value *json,
 
 void slack_set_info(PurpleConnection *gc, const char *info) {
 	SlackAccount *sa = gc->proto_data;
-	slack_api_post(sa, NULL, NULL, "users.profile.set", "name", "status_text", "value", info, NULL);
+	slack_api_post_priority(sa, SLACK_API_INTERACTIVE, NULL, NULL, "users.profile.set", "name", "status_text", "value", info, NULL);
 }
 
 void slack_get_info(PurpleConnection *gc, const char *who) {
@@ -272,7 +283,7 @@ void slack_get_info(PurpleConnection *gc, const char *who) {
 	if (!user)
 		users_info_cb(sa, g_strdup(who), NULL, NULL);
 	else
-		slack_api_post(sa, users_info_cb, g_strdup(who), "users.info", "user", user->object.id, NULL);
+		slack_api_post_priority(sa, SLACK_API_INTERACTIVE, users_info_cb, g_strdup(who), "users.info", "user", user->object.id, NULL);
 }
 
 static void avatar_load_next(SlackAccount *sa);
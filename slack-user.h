@@ -41,7 +41,7 @@ void slack_user_retrieve(SlackAccount *sa, const char *uid, SlackUserCallback *c
 
 /* RTM event handlers */
 void slack_user_changed(SlackAccount *sa, json_value *json);
-void slack_presence_change(SlackAccount *sa, json_value *json);
+void slack_presence_set(SlackAccount *sa, const char *id, const char *presence);
 
 /* Purple protocol handlers */
 void slack_set_info(PurpleConnection *gc, const char *info);
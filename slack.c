@@ -21,6 +21,7 @@
 #include "slack-blist.h"
 #include "slack-message.h"
 #include "slack-cmd.h"
+#include "slack-trace.h"
 
 static const char *slack_list_icon(G_GNUC_UNUSED PurpleAccount * account, G_GNUC_UNUSED PurpleBuddy * buddy) {
 	return "slack";
@@ -54,7 +55,7 @@ static GList *slack_status_types(G_GNUC_UNUSED PurpleAccount *acct) {
 
 static gboolean slack_set_profile(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
 	GString *profile_json = data;
-	slack_api_post(sa, NULL, NULL, "users.profile.set", "profile", profile_json->str, NULL);
+	slack_api_post_priority(sa, SLACK_API_INTERACTIVE, NULL, NULL, "users.profile.set", "profile", profile_json->str, NULL);
 	g_string_free(profile_json, TRUE);
 	return FALSE;
 }
@@ -79,7 +80,7 @@ static void slack_set_status(PurpleAccount *account, PurpleStatus *status) {
 		g_string_append(profile_json, "\"\"");
 	g_string_append(profile_json, ",\"status_emoji\":\"\"}");
 
-	slack_api_post(sa, slack_set_profile, profile_json, "users.setPresence", "presence", sa->away ? "away" : "auto", NULL);
+	slack_api_post_priority(sa, SLACK_API_INTERACTIVE, slack_set_profile, profile_json, "users.setPresence", "presence", sa->away ? "away" : "auto", NULL);
 }
 
 static void slack_set_idle(PurpleConnection *gc, int idle) {
@@ -87,7 +88,7 @@ static void slack_set_idle(PurpleConnection *gc, int idle) {
 		return;
 
 	SlackAccount *sa = gc->proto_data;
-	g_return_if_fail(sa && sa->rtm);
+	g_return_if_fail(sa);
 
 	if (sa->away)
 		return;
@@ -261,16 +262,21 @@ static void slack_login(PurpleAccount *account) {
 	}
 
 	g_queue_init(&sa->api_calls);
+	sa->api_cache = g_hash_table_new(g_str_hash, g_str_equal);
+	g_queue_init(&sa->api_cache_lru);
+	sa->api_cache_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
 	sa->rtm_call = g_hash_table_new_full(g_direct_hash,        g_direct_equal,        NULL, (GDestroyNotify)slack_rtm_cancel);
 
 	sa->users    = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, NULL, g_object_unref);
 	sa->user_names = g_hash_table_new_full(g_str_hash,         g_str_equal,           NULL, NULL);
 	sa->ims      = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, NULL, NULL);
+	sa->user_lookups = g_hash_table_new_full(g_str_hash,       g_str_equal,           NULL, NULL);
 
 	sa->channels = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, NULL, g_object_unref);
 	sa->channel_names = g_hash_table_new_full(g_str_hash,      g_str_equal,           NULL, NULL);
 	sa->channel_cids = g_hash_table_new_full(g_direct_hash,    g_direct_equal,        NULL, NULL);
+	sa->conversation_lookups = g_hash_table_new_full(g_str_hash, g_str_equal,         NULL, NULL);
 
 	g_queue_init(&sa->avatar_queue);
 
@@ -390,18 +396,14 @@ static void slack_close(PurpleConnection *gc) {
 		sa->mark_timer = 0;
 	}
 
-	if (sa->ping_timer) {
-		purple_timeout_remove(sa->ping_timer);
-		sa->ping_timer = 0;
-	}
-
-	if (sa->rtm) {
-		purple_websocket_abort(sa->rtm);
-		sa->rtm = NULL;
-	}
-	g_hash_table_destroy(sa->rtm_call);
+	slack_rtm_disconnect(sa);
 
 	slack_api_disconnect(sa);
+	g_hash_table_destroy(sa->api_cache);
+	g_hash_table_destroy(sa->api_cache_ids);
+	/* any lookups have now failed */
+	g_hash_table_destroy(sa->conversation_lookups);
+	g_hash_table_destroy(sa->user_lookups);
 
 	g_hash_table_destroy(sa->buddies);
 
@@ -556,6 +558,8 @@ static PurplePluginInfo info = {
 
 static void init_plugin(G_GNUC_UNUSED PurplePlugin *plugin)
 {
+	slack_trace_init(g_getenv("SLACK_TRACE"));
+
        prpl_info.user_splits = g_list_append(prpl_info.user_splits,
                purple_account_user_split_new("Host", "slack.com", '%'));
 
@@ -617,6 +621,12 @@ static void init_plugin(G_GNUC_UNUSED PurplePlugin *plugin)
 
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
 		purple_account_option_int_new("Seconds to delay when ratelimited", "ratelimit_delay", 15));
+
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_int_new("Maximum concurrent API requests", "api_concurrency", 4));
+
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_int_new("Socket Mode connections", "rtm_connections", 1));
 }
 
 PURPLE_INIT_PLUGIN(slack, init_plugin, info);
@@ -13,6 +13,13 @@
 
 #define MARK_LIST_END ((SlackObject *)1)
 
+typedef struct _SlackAPILimits SlackAPILimits;
+typedef struct _SlackAPIConn SlackAPIConn;
+typedef struct _SlackRTMConn SlackRTMConn;
+typedef struct _SlackRTMSeen SlackRTMSeen;
+typedef struct _SlackRTMBatch SlackRTMBatch;
+typedef struct _SlackAPIStats SlackAPIStats;
+
 typedef struct _SlackAccount {
 	PurpleAccount *account;
 	PurpleConnection *gc;
@@ -24,8 +31,20 @@ typedef struct _SlackAccount {
 	char *d_cookie;
 
 	short login_step;
-	GQueue api_calls; /* SlackAPICall */
-	PurpleWebsocket *rtm;
+	GQueue api_calls; /* SlackAPICall, in order of submission (waiting and running) */
+	guint api_running; /* number of api_calls currently being fetched */
+	guint api_run_timer;
+	SlackAPILimits *api_limits; /* ratelimit state per tier */
+	GSList *api_conns; /* SlackAPIConn pool */
+	struct _SlackRequestPrefix *api_prefix; /* static part of requests */
+	GString *api_body; /* scratch space for encoding requests */
+	GHashTable *api_cache; /* char *key -> struct api_cache_entry */
+	GQueue api_cache_lru;
+	GHashTable *api_cache_ids; /* char *channel or user id -> GList of struct api_cache_entry */
+	SlackAPIStats *api_stats;
+	GSList *rtm_conns; /* SlackRTMConn, the first being the one we logged in with */
+	SlackRTMSeen *rtm_seen; /* recently received envelopes and events */
+	SlackRTMBatch *rtm_batch; /* events waiting to be applied */
 	guint rtm_id;
 	GHashTable *rtm_call; /* unsigned rtm_id -> SlackRTMCall */
 	guint ping_timer;
@@ -40,11 +59,13 @@ typedef struct _SlackAccount {
 	GHashTable *users; /* slack_object_id user_id -> SlackUser (ref) */
 	GHashTable *user_names; /* char *user_name -> SlackUser (no ref) */
 	GHashTable *ims; /* slack_object_id im_id -> SlackUser (no ref) */
+	GHashTable *user_lookups; /* char *user_id -> struct user_retrieve (in flight) */
 
 	GHashTable *channels; /* slack_object_id channel_id -> SlackChannel (ref) */
 	GHashTable *channel_names; /* char *chan_name -> SlackChannel (no ref) */
 	int cid;
 	GHashTable *channel_cids; /* int purple_chat_id -> SlackChannel (no ref) */
+	GHashTable *conversation_lookups; /* char *conversation_id -> struct conversation_retrieve (in flight) */
 
 	PurpleGroup *blist; /* default group for ims/channels */
 	GHashTable *buddies; /* char *slack_id -> PurpleBListNode */